@@ -0,0 +1,175 @@
+#include "control.h"
+
+#include <sstream>
+#include <iomanip>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+kristforge::ControlServer::ControlServer(std::string path, std::vector<kristforge::Miner *> miners,
+                                         std::shared_ptr<kristforge::State> state,
+                                         std::shared_ptr<const kristforge::LatencyStats> latency) :
+		path(std::move(path)), miners(std::move(miners)), state(std::move(state)), latency(std::move(latency)) {
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+
+	if (this->path.size() >= sizeof(addr.sun_path)) throw std::invalid_argument("Control socket path too long");
+	this->path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) throw std::runtime_error("Unable to create control socket");
+
+	// replace a stale socket left behind by a previous run, but never some other file at a mistyped path
+	struct stat existing{};
+
+	if (lstat(this->path.data(), &existing) == 0) {
+		if (!S_ISSOCK(existing.st_mode)) {
+			close(fd);
+			throw std::runtime_error("Control socket path " + this->path + " exists and isn't a socket");
+		}
+
+		unlink(this->path.data());
+	}
+
+	if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+		close(fd);
+		throw std::runtime_error("Unable to listen on control socket " + this->path);
+	}
+
+	// the socket can pause and reconfigure miners, so only allow the owner to connect - clients are also checked on
+	// accept, as another user could connect before the permissions are changed
+	if (chmod(this->path.data(), 0600) != 0) {
+		close(fd);
+		unlink(this->path.data());
+		throw std::runtime_error("Unable to set permissions on control socket " + this->path);
+	}
+}
+
+kristforge::ControlServer::~ControlServer() {
+	close(fd);
+	unlink(path.data());
+}
+
+void kristforge::ControlServer::run() {
+	while (!state->isStopped()) {
+		int client = accept(fd, nullptr, nullptr);
+		if (client < 0) continue;
+
+		ucred peer{};
+		socklen_t peerLength = sizeof(peer);
+
+		if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &peerLength) != 0 || peer.uid != getuid()) {
+			close(client);
+			continue;
+		}
+
+		// clients are served one at a time, so don't let an idle one hold up the rest
+		timeval timeout{};
+		timeout.tv_sec = 5;
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+		serve(client);
+		close(client);
+	}
+}
+
+void kristforge::ControlServer::serve(int client) {
+	std::string buffer;
+	char chunk[256];
+
+	for (ssize_t n; (n = read(client, chunk, sizeof(chunk))) > 0;) {
+		buffer.append(chunk, n);
+
+		for (size_t end; (end = buffer.find('\n')) != std::string::npos;) {
+			std::string reply = execute(buffer.substr(0, end)) + "\n";
+			buffer.erase(0, end + 1);
+
+			if (write(client, reply.data(), reply.size()) < 0) return;
+		}
+	}
+}
+
+std::string kristforge::ControlServer::execute(const std::string &command) {
+	std::istringstream in(command);
+	std::string verb, which;
+	in >> verb;
+
+	if (verb == "stats") {
+		std::ostringstream out;
+
+		for (size_t i = 0; i < miners.size(); i++) {
+			auto stats = miners[i]->stats();
+			auto control = miners[i]->control();
+
+			out << i << " " << std::quoted(miners[i]->name())
+			    << " hashes " << stats->hashes
+			    << " effective " << static_cast<long>(stats->effectiveHashes(stats->shares))
+			    << " worksize " << (control->worksize ? control->worksize.load() : miners[i]->worksize())
+			    << " duty " << control->dutyCycle
+			    << " " << (control->paused ? "paused" : "running") << "\n";
+		}
+
+		out << "total " << state->hashesCompleted << " stale " << state->solutionsStale
+		    << " invalid " << state->solutionsInvalid << " dropped " << state->solutionsDropped << "\n";
+
+		// upper bounds in microseconds for each hop, then the total from being found to being acknowledged
+		if (latency) {
+			for (size_t i = 1; i <= solutionStageCount; i++) {
+				auto stage = static_cast<SolutionStage>(i % solutionStageCount);
+
+				out << "latency " << std::quoted(hopName(stage)) << " count " << latency->count(stage)
+				    << " p50 " << latency->quantile(stage, 0.5) << " p99 " << latency->quantile(stage, 0.99) << "\n";
+			}
+		}
+
+		out << "ok";
+		return out.str();
+	}
+
+	if (!(in >> which)) return "error: expected miner number or 'all'";
+
+	// select the miners to apply the command to
+	std::vector<Miner *> selected;
+
+	if (which == "all") {
+		selected = miners;
+	} else {
+		try {
+			size_t index = std::stoul(which);
+			if (index >= miners.size()) return "error: no miner " + which;
+			selected.push_back(miners[index]);
+		} catch (const std::logic_error &e) {
+			return "error: invalid miner " + which;
+		}
+	}
+
+	if (verb == "pause" || verb == "resume") {
+		for (Miner *m : selected) m->control()->paused = verb == "pause";
+		return "ok";
+	} else if (verb == "worksize") {
+		// read as signed, as negative sizes would otherwise wrap around to huge ones
+		long long ws;
+		if (!(in >> ws) || ws < 0) return "error: expected work size";
+
+		// check every miner first, so that the command is applied to all of them or none
+		for (Miner *m : selected) {
+			if (static_cast<unsigned long long>(ws) > m->maxWorksize()) {
+				return "error: work size for " + m->name() + " must be from 1 to " + std::to_string(m->maxWorksize()) +
+				       ", or 0 for the configured size";
+			}
+		}
+
+		for (Miner *m : selected) m->control()->worksize = static_cast<size_t>(ws);
+		return "ok";
+	} else if (verb == "duty") {
+		int duty;
+		if (!(in >> duty) || duty < 1 || duty > 100) return "error: expected duty cycle from 1 to 100";
+
+		for (Miner *m : selected) m->control()->dutyCycle = duty;
+		return "ok";
+	}
+
+	return "error: unknown command " + verb;
+}
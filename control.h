@@ -0,0 +1,58 @@
+#pragma once
+
+#include "miner.h"
+#include "state.h"
+#include "latency.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+
+namespace kristforge {
+	/**
+	 * A local control socket for adjusting miners at runtime. Clients connect to a unix domain socket and send one
+	 * command per line, and receive one or more lines in reply, the last being "ok" or starting with "error":
+	 *
+	 * stats                      - show live stats and settings for every miner, and solution latency quantiles
+	 * pause <miner|all>          - stop launching kernels, without losing the current target
+	 * resume <miner|all>         - resume launching kernels
+	 * worksize <miner|all> <n>   - change the global work size, up to a device limit, or 0 to use the configured size
+	 * duty <miner|all> <percent> - limit the percentage of time spent running kernels
+	 *
+	 * Miners are numbered from 0, in the order they were created.
+	 */
+	class ControlServer {
+	public:
+		/**
+		 * Create a control server listening on the given socket path - the miners must outlive it. If latency is set,
+		 * stats also reports solution latency quantiles.
+		 */
+		ControlServer(std::string path, std::vector<Miner *> miners, std::shared_ptr<State> state,
+		              std::shared_ptr<const LatencyStats> latency = nullptr);
+
+		ControlServer(const ControlServer &) = delete;
+
+		ControlServer &operator=(const ControlServer &) = delete;
+
+		~ControlServer();
+
+		/**
+		 * Accepts and serves clients synchronously, one at a time, until the state is stopped. A client which sends
+		 * nothing for a few seconds is disconnected.
+		 */
+		void run();
+
+		/** Executes a single command, returning the reply */
+		std::string execute(const std::string &command);
+
+	private:
+		const std::string path;
+		const std::vector<Miner *> miners;
+		const std::shared_ptr<State> state;
+		const std::shared_ptr<const LatencyStats> latency;
+		int fd;
+
+		/** Serve a single connected client until it disconnects */
+		void serve(int client);
+	};
+}
@@ -1,4 +1,10 @@
 // @formatter:off
+#ifndef NONCES_PER_ITEM
+	#define NONCES_PER_ITEM 1
+#elif NONCES_PER_ITEM < 1 || (NONCES_PER_ITEM & (NONCES_PER_ITEM - 1)) != 0
+	#error "Nonces per item must be a power of two"
+#endif
+
 #ifndef VECSIZE
 	#error "Vector size not defined"
 #elif VECSIZE == 2 || VECSIZE == 4 || VECSIZE == 8 || VECSIZE == 16
@@ -30,12 +36,32 @@
 #endif
 // @formatter:on
 
+// kernel variants - selected by the host using the following definitions:
+// RR_BITALIGN - use amd_bitalign for right rotates (requires cl_amd_media_ops)
+// CH_MAJ_CLASSIC - use plain boolean expressions instead of bitselect for CH/MAJ
+// SCHEDULE_ROLLING - keep a rolling 16-word message schedule instead of the full 64 words
+// K_IMMEDIATE - keep round constants in private memory so they can be folded into immediates
+
 // right rotate macro
-#define RR(x, y) rotate((UINTV)(x), -((UINTV)(y)))
+// @formatter:off
+#ifdef RR_BITALIGN
+	#pragma OPENCL EXTENSION cl_amd_media_ops : enable
+	#define RR(x, y) amd_bitalign((UINTV)(x), (UINTV)(x), (UINTV)(y))
+#else
+	#define RR(x, y) rotate((UINTV)(x), -((UINTV)(y)))
+#endif
+// @formatter:on
 
 // sha256 macros
-#define CH(x, y, z) bitselect((z),(y),(x))
-#define MAJ(x, y, z) bitselect((x),(y),(z)^(x))
+// @formatter:off
+#ifdef CH_MAJ_CLASSIC
+	#define CH(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+	#define MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#else
+	#define CH(x, y, z) bitselect((z),(y),(x))
+	#define MAJ(x, y, z) bitselect((x),(y),(z)^(x))
+#endif
+// @formatter:on
 #define EP0(x) (RR((x),2) ^ RR((x),13) ^ RR((x),22))
 #define EP1(x) (RR((x),6) ^ RR((x),11) ^ RR((x),25))
 #define SIG0(x) (RR((x),7) ^ RR((x),18) ^ ((x) >> 3))
@@ -53,21 +79,36 @@
 
 // sha256 round constants
 // @formatter:off
-__constant uint K[64] = {
-		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+#define K_VALUES { \
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5, \
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, \
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, \
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, \
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, \
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, \
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3, \
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 }
+
+#ifndef K_IMMEDIATE
+__constant uint K[64] = K_VALUES;
+#endif
 // @formatter:on
 
 // perform a single round of sha256 transformation on the given data
 void sha256_transform(UCHARV *data, UINTV *H) {
 	int i;
+
+#ifdef K_IMMEDIATE
+	const uint K[64] = K_VALUES;
+#endif
+
+#ifdef SCHEDULE_ROLLING
+	UINTV a, b, c, d, e, f, g, h, t1, t2, m[16];
+	#define W(i) m[(i) & 15]
+#else
 	UINTV a, b, c, d, e, f, g, h, t1, t2, m[64];
+	#define W(i) m[(i)]
+#endif
 
 #pragma unroll
 	for (i = 0; i < 16; i++) {
@@ -77,8 +118,10 @@ void sha256_transform(UCHARV *data, UINTV *H) {
 		       (CONVERT(UINTV, data[i * 4 + 3]));
 	}
 
+#ifndef SCHEDULE_ROLLING
 #pragma unroll
 	for (i = 16; i < 64; i++) m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
+#endif
 
 	a = H[0];
 	b = H[1];
@@ -91,7 +134,11 @@ void sha256_transform(UCHARV *data, UINTV *H) {
 
 #pragma unroll
 	for (i = 0; i < 64; i++) {
-		t1 = h + EP1(e) + CH(e, f, g) + K[i] + m[i];
+#ifdef SCHEDULE_ROLLING
+		if (i >= 16) W(i) += SIG1(W(i - 2)) + W(i - 7) + SIG0(W(i - 15));
+#endif
+
+		t1 = h + EP1(e) + CH(e, f, g) + K[i] + W(i);
 		t2 = EP0(a) + MAJ(a, b, c);
 		h = g;
 		g = f;
@@ -103,6 +150,8 @@ void sha256_transform(UCHARV *data, UINTV *H) {
 		a = t1 + t2;
 	}
 
+#undef W
+
 	H[0] += a;
 	H[1] += b;
 	H[2] += c;
@@ -212,10 +261,13 @@ void kristMiner(
 		__global const uchar *prefix,               // 2 bytes
 		const long offset,
 		const long work,                            // convert to 13 bytes
-		__global uchar *solution) {                  // 15 bytes (prefix + nonce)
+		__global uchar *solution,                   // 15 bytes (prefix + nonce)
+		const long shareWork,                       // easier threshold for counting near misses
+		__global uint *shares) {                    // near miss count, accumulated across launches
 
-	// TODO: figure out why this is slower?
-	const LONGV nonce = nonceOffset.vec + (LONGV)(get_global_id(0) * VECSIZE + offset);
+	// the host aligns offsets to VECSIZE * NONCES_PER_ITEM, which is at most 1024, so the nonces of this work item
+	// only differ in their two lowest characters (10 bits) and the rest of the message is encoded just once
+	const long base = get_global_id(0) * VECSIZE * NONCES_PER_ITEM + offset;
 
 	UCHARV input[64] = {0}, hashed[32] = {0};
 
@@ -229,35 +281,64 @@ void kristMiner(
 	for (int i = 0; i < 2; i++) input[i+22] = prefix[i];
 
 #pragma unroll
-	for (int i = 0; i < 13; i++) input[i+24] = CONVERT(UCHARV, ((nonce >> (i * 5)) & 0b11111) + 48);
+	for (int i = 2; i < 13; i++) input[i+24] = (UCHARV)(((base >> (i * 5)) & 0b11111) + 48);
+
+	uint hits = 0;
+
+	for (int n = 0; n < NONCES_PER_ITEM; n++) {
+		const LONGV low = nonceOffset.vec + (LONGV)((base & 1023) + n * VECSIZE);
+		input[24] = CONVERT(UCHARV, (low & 0b11111) + 48);
+		input[25] = CONVERT(UCHARV, ((low >> 5) & 0b11111) + 48);
 
-	digest55(input, 37, hashed);
+		digest55(input, 37, hashed);
 
-	LONGV score = score_hash(hashed);
+		LONGV score = score_hash(hashed);
 
 #if VECSIZE == 1
-	if (score < work) {
+		hits += score < shareWork;
+#else
+		union {
+			LONGV vector;
+			long components[VECSIZE];
+		} below = { .vector = score < shareWork };
+
 #pragma unroll
-		for (int i = 0; i < 15; i++) {
-			solution[i] = input[i+22];
+		for (int i = 0; i < VECSIZE; i++) hits -= below.components[i];
+#endif
+
+#if VECSIZE == 1
+		if (score < work) {
+#pragma unroll
+			for (int i = 0; i < 15; i++) {
+				solution[i] = input[i+22];
+			}
 		}
-	}
 #else
-	if (any(score < work)) {
+		if (any(score < work)) {
 #pragma unroll
-		for (int i = 0; i < VECSIZE; i++) {
-			union vectorExtractor *hash = (union vectorExtractor*) hashed;
+			for (int i = 0; i < VECSIZE; i++) {
+				union vectorExtractor *hash = (union vectorExtractor*) hashed;
 
-			uchar start[6] = {0};
+				uchar start[6] = {0};
 
 #pragma unroll
-			for (int j = 0; j < 6; j++) start[j] = hash[j].components[i];
+				for (int j = 0; j < 6; j++) start[j] = hash[j].components[i];
 
-			if (score_hash_scalar(start) < work) {
+				if (score_hash_scalar(start) < work) {
 #pragma unroll
-				for (int k = 0; k < 15; k++) solution[k] = ((union vectorExtractor)input[22 + k]).components[i];
+					for (int k = 0; k < 15; k++) solution[k] = ((union vectorExtractor)input[22 + k]).components[i];
+				}
 			}
 		}
-	}
 #endif
+	}
+
+	// count near misses, reduced across the work group so only one global atomic is needed per group
+	__local uint groupShares;
+	if (get_local_id(0) == 0) groupShares = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (hits) atomic_add(&groupShares, hits);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (get_local_id(0) == 0 && groupShares) atomic_add(shares, groupShares);
 }
\ No newline at end of file
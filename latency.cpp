@@ -0,0 +1,92 @@
+#include "latency.h"
+
+#include <sstream>
+
+/** Display names for each stage */
+static const char *stageNames[] = {"found", "queued", "popped", "handed off", "sent", "acknowledged"};
+
+const char *kristforge::hopName(kristforge::SolutionStage stage) {
+	return stage == SolutionStage::Found ? "total" : stageNames[static_cast<size_t>(stage)];
+}
+
+long kristforge::stageLatency(const kristforge::Solution &solution, kristforge::SolutionStage from,
+                              kristforge::SolutionStage to) {
+	auto start = solution.timestamp(from), end = solution.timestamp(to);
+
+	if (start.time_since_epoch().count() == 0 || end.time_since_epoch().count() == 0) return -1;
+
+	return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+std::string kristforge::describeLatency(const kristforge::Solution &solution) {
+	std::ostringstream out;
+
+	for (size_t i = 1; i < solutionStageCount; i++) {
+		long micros = stageLatency(solution, static_cast<SolutionStage>(i - 1), static_cast<SolutionStage>(i));
+
+		if (i > 1) out << ", ";
+		out << stageNames[i] << " +" << (micros < 0 ? "?" : std::to_string(micros)) << "us";
+	}
+
+	return out.str();
+}
+
+void kristforge::LatencyStats::Histogram::add(long micros) {
+	size_t bucket = 0;
+	while (bucket < bucketCount - 1 && (1L << bucket) <= micros) bucket++;
+
+	buckets[bucket]++;
+	count++;
+
+	long prev = max;
+	while (prev < micros && !max.compare_exchange_weak(prev, micros));
+}
+
+long kristforge::LatencyStats::Histogram::quantile(double q) const {
+	long total = count, seen = 0;
+
+	for (size_t i = 0; i < bucketCount; i++) {
+		seen += buckets[i];
+		if (total > 0 && seen >= q * total) return 1L << i;
+	}
+
+	return 1L << (bucketCount - 1);
+}
+
+void kristforge::LatencyStats::record(const kristforge::Solution &solution) {
+	for (size_t i = 1; i < solutionStageCount; i++) {
+		long micros = stageLatency(solution, static_cast<SolutionStage>(i - 1), static_cast<SolutionStage>(i));
+		if (micros >= 0) histograms[i].add(micros);
+	}
+
+	long total = stageLatency(solution, SolutionStage::Found, SolutionStage::Acknowledged);
+	if (total >= 0) histograms[0].add(total);
+}
+
+long kristforge::LatencyStats::count(kristforge::SolutionStage stage) const {
+	return histograms[static_cast<size_t>(stage)].count;
+}
+
+long kristforge::LatencyStats::quantile(kristforge::SolutionStage stage, double q) const {
+	return histograms[static_cast<size_t>(stage)].quantile(q);
+}
+
+void kristforge::LatencyStats::print(std::ostream &os) const {
+	const char *fmt = "%-14.14s | %8s | %10s | %10s | %10s | %10s\n";
+	char line[128];
+
+	snprintf(line, sizeof(line), fmt, "Stage", "Count", "p50 (us)", "p90 (us)", "p99 (us)", "Max (us)");
+	os << line;
+
+	for (size_t i = 0; i < histogramCount; i++) {
+		const Histogram &h = histograms[i];
+
+		snprintf(line, sizeof(line), fmt, hopName(static_cast<SolutionStage>(i)),
+		         std::to_string(h.count).data(),
+		         ("<" + std::to_string(h.quantile(0.5))).data(),
+		         ("<" + std::to_string(h.quantile(0.9))).data(),
+		         ("<" + std::to_string(h.quantile(0.99))).data(),
+		         std::to_string(h.max).data());
+		os << line;
+	}
+}
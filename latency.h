@@ -0,0 +1,64 @@
+#pragma once
+
+#include "state.h"
+
+#include <array>
+#include <atomic>
+#include <string>
+#include <ostream>
+
+namespace kristforge {
+	/**
+	 * Latency histograms for each hop a solution makes between stages, plus the total from being found to being
+	 * acknowledged. Buckets are powers of two in microseconds. Safe to record and read from any thread.
+	 */
+	class LatencyStats {
+	public:
+		/** Number of histogram buckets - bucket i holds latencies below 2^i microseconds */
+		static constexpr size_t bucketCount = 32;
+
+		/** Number of histograms - one per hop, plus the total */
+		static constexpr size_t histogramCount = solutionStageCount;
+
+		LatencyStats() = default;
+
+		LatencyStats(const LatencyStats &) = delete;
+
+		LatencyStats &operator=(const LatencyStats &) = delete;
+
+		/** Record the latencies of every hop of the given solution which has timestamps on both ends */
+		void record(const Solution &solution);
+
+		/** Get the number of samples recorded for the hop ending at the given stage - Found gives the total */
+		long count(SolutionStage stage) const;
+
+		/** Get an upper bound on the given quantile (0-1) in microseconds for the hop ending at the given stage - Found gives the total */
+		long quantile(SolutionStage stage, double q) const;
+
+		/** Write a summary of all histograms */
+		void print(std::ostream &os) const;
+
+	private:
+		struct Histogram {
+			std::array<std::atomic<long>, bucketCount> buckets{};
+			std::atomic<long> count = 0;
+			std::atomic<long> max = 0;
+
+			void add(long micros);
+
+			long quantile(double q) const;
+		};
+
+		/** Histogram i holds the hop ending at stage i, except the first which holds the total */
+		std::array<Histogram, histogramCount> histograms;
+	};
+
+	/** Get the display name of the hop ending at the given stage - Found gives the total */
+	const char *hopName(SolutionStage stage);
+
+	/** Get the latency between two stages of a solution in microseconds, or -1 if either isn't set */
+	long stageLatency(const Solution &solution, SolutionStage from, SolutionStage to);
+
+	/** Describe the latency of each hop of the given solution, for logging */
+	std::string describeLatency(const Solution &solution);
+}
@@ -0,0 +1,341 @@
+#include "logger.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <stdexcept>
+
+kristforge::LogLevel kristforge::parseLogLevel(const std::string &name) {
+	if (name == "debug") return LogLevel::Debug;
+	if (name == "info") return LogLevel::Info;
+	if (name == "warning") return LogLevel::Warning;
+	if (name == "error") return LogLevel::Error;
+	throw std::invalid_argument("Unknown log level: " + name);
+}
+
+static const char *levelName(kristforge::LogLevel level) {
+	switch (level) {
+		case kristforge::LogLevel::Debug: return "debug";
+		case kristforge::LogLevel::Info: return "info";
+		case kristforge::LogLevel::Warning: return "warning";
+		default: return "error";
+	}
+}
+
+/** Write a string as a quoted JSON string */
+static void writeJSONString(std::ostream &os, std::string_view s) {
+	static const char hex[] = "0123456789abcdef";
+	os << '"';
+
+	for (char c : s) {
+		switch (c) {
+			case '"': os << "\\\""; break;
+			case '\\': os << "\\\\"; break;
+			case '\n': os << "\\n"; break;
+			case '\r': os << "\\r"; break;
+			case '\t': os << "\\t"; break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20) {
+					os << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+				} else {
+					os << c;
+				}
+		}
+	}
+
+	os << '"';
+}
+
+kristforge::Logger::Logger(LogLevel level, std::ostream &console, const std::optional<std::string> &path) :
+		level(level),
+		console(console) {
+	if (path) {
+		file.emplace(*path, std::ios::out | std::ios::app);
+		if (!*file) throw std::runtime_error("Unable to open log file for writing: " + *path);
+	}
+
+	drainer = std::thread(&Logger::drain, this);
+}
+
+kristforge::Logger::~Logger() {
+	stopped = true;
+	drainer.join();
+}
+
+void kristforge::Logger::log(LogLevel l, LogEvent event, std::string_view key, std::string_view text, long a, long b, long c) {
+	if (!enabled(l)) return;
+
+	Record r;
+	r.time = std::chrono::system_clock::now();
+	r.level = l;
+	r.event = event;
+	r.values[0] = a;
+	r.values[1] = b;
+	r.values[2] = c;
+	r.keyLength = static_cast<unsigned short>(std::min(key.size(), sizeof(r.key)));
+	r.textLength = static_cast<unsigned short>(std::min(text.size(), sizeof(r.text)));
+	r.truncated = key.size() > sizeof(r.key) || text.size() > sizeof(r.text);
+	std::memcpy(r.key, key.data(), r.keyLength);
+	std::memcpy(r.text, text.data(), r.textLength);
+
+	if (ring.push(r)) {
+		eventsQueued++;
+	} else {
+		eventsDropped++;
+	}
+}
+
+void kristforge::Logger::message(LogLevel l, std::string_view text) {
+	log(l, LogEvent::Message, {}, text);
+}
+
+void kristforge::Logger::target(const Target &target) {
+	log(LogLevel::Info, LogEvent::Target, target.prevBlock(), {}, target.work);
+}
+
+void kristforge::Logger::noTarget() {
+	log(LogLevel::Info, LogEvent::NoTarget, {}, {});
+}
+
+void kristforge::Logger::submitted(const Solution &solution) {
+	log(LogLevel::Debug, LogEvent::Submitted, solution.nonce(), {});
+}
+
+void kristforge::Logger::accepted(const Solution &solution, long height) {
+	log(LogLevel::Info, LogEvent::Accepted, solution.nonce(), {}, height);
+}
+
+void kristforge::Logger::rejected(const Solution &solution, std::string_view reason) {
+	log(LogLevel::Warning, LogEvent::Rejected, solution.nonce(), reason);
+}
+
+void kristforge::Logger::slowSolution(const Solution &solution, long micros, std::string_view description) {
+	log(LogLevel::Warning, LogEvent::SlowSolution, solution.nonce(), description, micros);
+}
+
+void kristforge::Logger::hashrate(long hashesPerSecond, long stale, long invalid) {
+	log(LogLevel::Info, LogEvent::Hashrate, {}, {}, hashesPerSecond, stale, invalid);
+}
+
+void kristforge::Logger::deviceHashrate(std::string_view device, long effectiveHashesPerSecond) {
+	log(LogLevel::Info, LogEvent::DeviceHashrate, device, {}, effectiveHashesPerSecond);
+}
+
+void kristforge::Logger::connected(std::string_view node) {
+	log(LogLevel::Info, LogEvent::Connected, node, {});
+}
+
+void kristforge::Logger::connectError(std::string_view node, std::string_view error) {
+	log(LogLevel::Warning, LogEvent::ConnectError, node, error);
+}
+
+void kristforge::Logger::disconnected(std::string_view node, bool reconnecting) {
+	log(LogLevel::Warning, LogEvent::Disconnected, node, {}, reconnecting);
+}
+
+void kristforge::Logger::raw(std::string_view node, std::string_view text) {
+	log(LogLevel::Debug, LogEvent::Raw, node, text);
+}
+
+void kristforge::Logger::flush() {
+	long target = eventsQueued;
+	while (eventsWritten < target) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+void kristforge::Logger::drain() {
+	Record r;
+
+	for (;;) {
+		// read the flag before draining, so nothing queued before stopping is missed
+		bool stopping = stopped;
+		long written = 0;
+
+		while (ring.pop(r)) {
+			writeText(r);
+			if (file) writeJSON(r);
+			written++;
+		}
+
+		if (written > 0) {
+			// flush once per batch rather than once per line
+			console.flush();
+			if (file) file->flush();
+			eventsWritten += written;
+		} else if (stopping) {
+			return;
+		} else {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+}
+
+void kristforge::Logger::writeText(const Record &r) {
+	std::string_view key(r.key, r.keyLength), text(r.text, r.textLength);
+
+	switch (r.event) {
+		case LogEvent::Message:
+			console << text;
+			break;
+
+		case LogEvent::Target:
+			console << "New target: block " << key << ", work " << r.values[0];
+			break;
+
+		case LogEvent::NoTarget:
+			console << "No target - waiting for a node";
+			break;
+
+		case LogEvent::Submitted:
+			console << "Submitting solution (nonce " << key << ")";
+			break;
+
+		case LogEvent::Accepted:
+			console << "Successfully mined block #" << r.values[0] << " (nonce " << key << ")";
+			break;
+
+		case LogEvent::Rejected:
+			console << "Solution (nonce " << key << ") rejected: " << text;
+			break;
+
+		case LogEvent::SlowSolution:
+			console << "Slow solution (nonce " << key << "): " << text;
+			break;
+
+		case LogEvent::Hashrate:
+			console << formatHashrate(r.values[0]);
+
+			// solutions discarded before submission - invalid ones suggest a miscompiled kernel
+			if (r.values[1] || r.values[2]) {
+				console << " (discarded " << r.values[1] << " stale, " << r.values[2] << " invalid solutions)";
+			}
+
+			// read when written rather than when queued, so that the count includes drops since this was logged
+			if (long lost = dropped()) console << " (" << lost << " log events dropped)";
+			break;
+
+		case LogEvent::DeviceHashrate:
+			console << "  " << key << ": effective " << formatHashrate(r.values[0]);
+			break;
+
+		case LogEvent::Connected:
+			console << "Connected to " << key;
+			break;
+
+		case LogEvent::ConnectError:
+			console << "Unable to connect to " << key << ": " << text;
+			break;
+
+		case LogEvent::Disconnected:
+			console << "Disconnected from " << key << (r.values[0] ? " - trying to reconnect..." : "");
+			break;
+
+		case LogEvent::Raw:
+			console << key << ": " << text;
+			break;
+	}
+
+	if (r.truncated) console << "...";
+	console << "\n";
+}
+
+void kristforge::Logger::writeJSON(const Record &r) {
+	static const char *eventNames[] = {
+			"message", "target", "no_target", "submitted", "accepted", "rejected", "slow_solution", "hashrate",
+			"device_hashrate", "connected", "connect_error", "disconnected", "raw"
+	};
+
+	std::ostream &os = *file;
+	std::string_view key(r.key, r.keyLength), text(r.text, r.textLength);
+
+	// ISO 8601 UTC timestamp with milliseconds
+	std::time_t seconds = std::chrono::system_clock::to_time_t(r.time);
+	auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(r.time.time_since_epoch()).count() % 1000;
+	std::tm utc{};
+	gmtime_r(&seconds, &utc);
+
+	os << R"({"time":")" << std::put_time(&utc, "%Y-%m-%dT%H:%M:%S") << "."
+	   << std::setw(3) << std::setfill('0') << millis << std::setfill(' ') << R"(Z","level":")" << levelName(r.level)
+	   << R"(","event":")" << eventNames[static_cast<size_t>(r.event)] << '"';
+
+	switch (r.event) {
+		case LogEvent::Message:
+			os << R"(,"message":)";
+			writeJSONString(os, text);
+			break;
+
+		case LogEvent::Target:
+			os << R"(,"block":)";
+			writeJSONString(os, key);
+			os << R"(,"work":)" << r.values[0];
+			break;
+
+		case LogEvent::NoTarget:
+			break;
+
+		case LogEvent::Submitted:
+			os << R"(,"nonce":)";
+			writeJSONString(os, key);
+			break;
+
+		case LogEvent::Accepted:
+			os << R"(,"nonce":)";
+			writeJSONString(os, key);
+			os << R"(,"height":)" << r.values[0];
+			break;
+
+		case LogEvent::Rejected:
+			os << R"(,"nonce":)";
+			writeJSONString(os, key);
+			os << R"(,"reason":)";
+			writeJSONString(os, text);
+			break;
+
+		case LogEvent::SlowSolution:
+			os << R"(,"nonce":)";
+			writeJSONString(os, key);
+			os << R"(,"latency_us":)" << r.values[0] << R"(,"stages":)";
+			writeJSONString(os, text);
+			break;
+
+		case LogEvent::Hashrate:
+			os << R"(,"hashrate":)" << r.values[0] << R"(,"stale":)" << r.values[1] << R"(,"invalid":)" << r.values[2]
+			   << R"(,"log_dropped":)" << dropped();
+			break;
+
+		case LogEvent::DeviceHashrate:
+			os << R"(,"device":)";
+			writeJSONString(os, key);
+			os << R"(,"effective_hashrate":)" << r.values[0];
+			break;
+
+		case LogEvent::Connected:
+			os << R"(,"node":)";
+			writeJSONString(os, key);
+			break;
+
+		case LogEvent::ConnectError:
+			os << R"(,"node":)";
+			writeJSONString(os, key);
+			os << R"(,"error":)";
+			writeJSONString(os, text);
+			break;
+
+		case LogEvent::Disconnected:
+			os << R"(,"node":)";
+			writeJSONString(os, key);
+			os << R"(,"reconnecting":)" << (r.values[0] ? "true" : "false");
+			break;
+
+		case LogEvent::Raw:
+			os << R"(,"node":)";
+			writeJSONString(os, key);
+			os << R"(,"message":)";
+			writeJSONString(os, text);
+			break;
+	}
+
+	if (r.truncated) os << R"(,"truncated":true)";
+	os << "}\n";
+}
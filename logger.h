@@ -0,0 +1,133 @@
+#pragma once
+
+#include "state.h"
+#include "ring.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace kristforge {
+	/** Severity of a logged event - events below the logger's level are dropped before being queued */
+	enum class LogLevel { Debug, Info, Warning, Error };
+
+	/** Parse a log level name (debug, info, warning or error), throwing std::invalid_argument if unknown */
+	LogLevel parseLogLevel(const std::string &name);
+
+	/** Kinds of event which can be logged, each with its own set of fields */
+	enum class LogEvent {
+		Message, Target, NoTarget, Submitted, Accepted, Rejected, SlowSolution, Hashrate, DeviceHashrate, Connected,
+		ConnectError, Disconnected, Raw
+	};
+
+	/**
+	 * Asynchronous structured event logger. Events are copied into a fixed-size record and pushed onto a lock-free
+	 * ring without allocating or blocking, then formatted and written by a background thread - so logging never
+	 * stalls the mining or networking threads. Events are written to the console in a human readable form and, if
+	 * a file is given, to that file as JSON lines. If the ring fills up, events are dropped and counted.
+	 */
+	class Logger {
+	public:
+		/** Create a logger writing events at or above level to console, and optionally to a JSON lines file */
+		Logger(LogLevel level, std::ostream &console, const std::optional<std::string> &file = std::nullopt);
+
+		Logger(const Logger &) = delete;
+
+		Logger &operator=(const Logger &) = delete;
+
+		/** Stops the background thread after writing any queued events */
+		~Logger();
+
+		/** Whether events at the given level will be logged */
+		inline bool enabled(LogLevel l) const { return l >= level; }
+
+		/** Log a free-form message */
+		void message(LogLevel l, std::string_view text);
+
+		/** Log the mining target changing */
+		void target(const Target &target);
+
+		/** Log the mining target being unset */
+		void noTarget();
+
+		/** Log a solution being submitted */
+		void submitted(const Solution &solution);
+
+		/** Log a solution being accepted */
+		void accepted(const Solution &solution, long height);
+
+		/** Log a solution being rejected */
+		void rejected(const Solution &solution, std::string_view reason);
+
+		/** Log a solution which took too long to be acknowledged, with its total latency and a breakdown */
+		void slowSolution(const Solution &solution, long micros, std::string_view description);
+
+		/**
+		 * Log a sample of the total hashrate, along with the number of solutions discarded so far - the number of
+		 * events dropped by this logger is included when it's written
+		 */
+		void hashrate(long hashesPerSecond, long stale, long invalid);
+
+		/** Log a sample of the effective hashrate of a single device */
+		void deviceHashrate(std::string_view device, long effectiveHashesPerSecond);
+
+		/** Log a node connection being established */
+		void connected(std::string_view node);
+
+		/** Log a failed attempt to connect to a node */
+		void connectError(std::string_view node, std::string_view error);
+
+		/** Log a node connection being dropped */
+		void disconnected(std::string_view node, bool reconnecting);
+
+		/** Log a raw message received from a node */
+		void raw(std::string_view node, std::string_view text);
+
+		/** Block until every event logged so far has been written and flushed */
+		void flush();
+
+		/** Get the number of events dropped because the ring was full */
+		inline long dropped() const { return eventsDropped; }
+
+	private:
+		struct Record {
+			std::chrono::system_clock::time_point time;
+			LogLevel level;
+			LogEvent event;
+			long values[3];
+			unsigned short keyLength;
+			unsigned short textLength;
+			bool truncated;
+			char key[96];
+			char text[512];
+		};
+
+		const LogLevel level;
+		std::ostream &console;
+		std::optional<std::ofstream> file;
+
+		MPSCRing<Record, 1024> ring;
+		std::atomic<long> eventsQueued = 0;
+		std::atomic<long> eventsWritten = 0;
+		std::atomic<long> eventsDropped = 0;
+		std::atomic<bool> stopped = false;
+		std::thread drainer;
+
+		/** Fill in a record and queue it, unless filtered out by level */
+		void log(LogLevel l, LogEvent event, std::string_view key, std::string_view text, long a = 0, long b = 0, long c = 0);
+
+		/** Background thread - pops and writes records until stopped and empty */
+		void drain();
+
+		/** Write a record to the console in human readable form */
+		void writeText(const Record &r);
+
+		/** Write a record to the file as a single JSON object */
+		void writeJSON(const Record &r);
+	};
+}
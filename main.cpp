@@ -1,12 +1,18 @@
 #include "network.h"
 #include "miner.h"
+#include "scheduler.h"
+#include "control.h"
+#include "logger.h"
+#include "utils.h"
 
 #include <iostream>
+#include <sstream>
 #include <thread>
 #include <vector>
 #include <set>
 #include <algorithm>
-#include <random>
+#include <csignal>
+#include <pthread.h>
 #include <tclap/CmdLine.h>
 
 class AddressConstraint : public TCLAP::Constraint<std::string> {
@@ -18,6 +24,15 @@ public:
 	bool check(const std::string &value) const override { return value.size() == 10; }
 };
 
+class PositiveConstraint : public TCLAP::Constraint<double> {
+public:
+	std::string description() const override { return "number greater than zero"; }
+
+	std::string shortID() const override { return "multiplier"; }
+
+	bool check(const double &value) const override { return value > 0; }
+};
+
 void printDeviceList() {
 	const char *fmtString = "%-30.30s | %-15.15s | %-7.7s\n";
 	printf(fmtString, "Device", "ID", "Score");
@@ -32,37 +47,27 @@ void printDeviceList() {
 	}
 }
 
+void printVariantList() {
+	const char *fmtString = "%-20.20s | %-20.20s | %s\n";
+	printf(fmtString, "Variant", "Requires", "Options");
+
+	for (const kristforge::KernelVariant &v : kristforge::kernelVariants()) {
+		printf(fmtString, v.name.data(), v.requiredExtension.value_or("(none)").data(), v.defines.data());
+	}
+}
+
 struct DeviceComparator {
 	bool operator()(const cl::Device &a, const cl::Device &b) const {
 		return a() == b();
 	}
 };
 
-/** Randomly generate a 2-character miner prefix */
-std::string generatePrefix() {
-	static std::random_device rd;
-	static std::mt19937 gen(rd());
-	static std::uniform_int_distribution<int> dist(0, 255);
-
-	char prefix[3];
-	snprintf(prefix, 3, "%0.2x", dist(gen));
-	return std::string(prefix);
-}
-
-std::string formatHashrate(long hashesPerSecond) {
-	static const char *suffixes[] = {"h/s", "kh/s", "Mh/s", "Gh/s", "Th/s"};
-
-	auto scale = std::max(0, static_cast<int>(0, log(hashesPerSecond) / log(1000)));
-	double value = hashesPerSecond / pow(1000, scale);
-
-	std::stringstream out;
-	out << std::fixed << std::setprecision(2) << value << " " << suffixes[scale];
-	return out.str();
-}
-
 int main(int argc, char **argv) {
 	TCLAP::CmdLine cmd("Mine krist using OpenCL devices");
 
+	std::vector<std::string> logLevelNames{"debug", "info", "warning", "error"};
+	TCLAP::ValuesConstraint<std::string> logLevels(logLevelNames);
+
 	// @formatter:off
 	TCLAP::UnlabeledValueArg<std::string> addressArg("address", "Address to mine for", false, "k5ztameslf", new AddressConstraint, cmd);
 	TCLAP::SwitchArg listDevicesArg("l", "list-devices", "List OpenCL devices and exit", cmd);
@@ -70,22 +75,73 @@ int main(int argc, char **argv) {
 	TCLAP::SwitchArg bestDeviceArg("b", "best-device", "Use best OpenCL device to mine", cmd);
 	TCLAP::MultiArg<std::string> deviceIDsArg("d", "device-id", "Use OpenCL devices by ID to mine", false, "device id", cmd);
 	TCLAP::MultiArg<int> deviceNumsArg("", "device-num", "Use OpenCL devices by position in list (not recommended)", false, "device num", cmd);
-	TCLAP::ValueArg<std::string> kristNode("", "node", "Use custom krist node", false, "https://krist.ceriat.net/ws/start", "WS init url", cmd);
+	TCLAP::MultiArg<std::string> kristNodes("", "node", "Use custom krist node (can be repeated to race submissions across several nodes)", false, "WS init url", cmd);
 	TCLAP::ValueArg<int> vecsizeArg("V", "vector-width", "Manually set vector width for all devices", false, 1, "1 | 2 | 4 | 8 | 16", cmd);
 	TCLAP::ValueArg<size_t> worksizeArg("w", "worksize", "Manually set work group size for all devices", false, 1, "size", cmd);
+	TCLAP::ValueArg<unsigned int> noncesPerItemArg("K", "nonces-per-item", "Manually set the number of nonces each work item hashes for all devices", false, 1, "1 | 2 | 4 | ... | 1024", cmd);
 	TCLAP::SwitchArg onlyTestArg("t", "only-test", "Run tests on selected miners and then exit", cmd);
 	TCLAP::ValueArg<std::string> clCompilerArg("", "cl-opts", "Extra options for the OpenCL compiler", false, "", "options", cmd);
+	TCLAP::ValueArg<std::string> variantArg("", "kernel-variant", "Use the given kernel variant for all devices instead of benchmarking", false, "", "variant", cmd);
+	TCLAP::SwitchArg listVariantsArg("", "list-variants", "List kernel variants and exit", cmd);
 	TCLAP::MultiSwitchArg verboseArg("v", "verbose", "Enable extra logging (can be repeated up to two times)", cmd);
 	TCLAP::ValueArg<int> exitAfterArg("", "exit-after", "Stop after mining for given number of seconds", false, 0, "seconds", cmd);
+	TCLAP::ValueArg<std::string> recordArg("", "record", "Record target changes and submission replies to a trace file", false, "", "file", cmd);
+	TCLAP::ValueArg<std::string> replayArg("", "replay", "Replay a recorded trace instead of connecting to a node", false, "", "file", cmd);
+	TCLAP::SwitchArg speculativeArg("", "speculative", "Start mining the predicted next block as soon as a solution is found", cmd);
+	TCLAP::ValueArg<long> slowSolutionArg("", "slow-solution-ms", "Log solutions taking longer than this to be acknowledged", false, 500, "milliseconds", cmd);
+	TCLAP::ValueArg<unsigned int> schedulerThreadsArg("", "scheduler-threads", "Drive all devices from this many event-driven threads instead of one thread per device", false, 1, "threads", cmd);
+	TCLAP::ValueArg<unsigned int> schedulerCPUArg("", "scheduler-cpu", "Pin event-driven scheduler threads to CPUs starting from this one - uses the scheduler even without --scheduler-threads", false, 0, "cpu", cmd);
+	TCLAP::ValueArg<std::string> controlSocketArg("", "control-socket", "Listen for runtime control commands on this unix socket", false, "", "path", cmd);
+	TCLAP::ValueArg<std::string> journalArg("", "journal", "Remember searched nonce ranges in this file, so restarts don't search them again", false, "", "file", cmd);
+	TCLAP::ValueArg<std::uint32_t> nodeIDArg("", "node-id", "Unique 24-bit ID for this host, used to keep nonce ranges disjoint across hosts", false, 0, "id", cmd);
+	TCLAP::ValueArg<std::string> logFileArg("", "log-file", "Append structured events to this file as JSON lines", false, "", "file", cmd);
+	TCLAP::ValueArg<std::string> logLevelArg("", "log-level", "Only log events at or above this level (defaults to debug if verbose, otherwise info)", false, "info", &logLevels, cmd);
+	TCLAP::ValueArg<double> replaySpeedArg("", "replay-speed", "Speed multiplier for trace replay", false, 1, new PositiveConstraint, cmd);
 	// @formatter:on
 
 	cmd.parse(argc, argv);
 
+	// block stop signals before any other threads exist, so that they're only delivered to the signal thread below
+	sigset_t stopSignals;
+	sigemptyset(&stopSignals);
+	sigaddset(&stopSignals, SIGINT);
+	sigaddset(&stopSignals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+
+	// init logging
+	kristforge::LogLevel logLevel = verboseArg.isSet() ? kristforge::LogLevel::Debug : kristforge::LogLevel::Info;
+	if (logLevelArg.isSet()) logLevel = kristforge::parseLogLevel(logLevelArg.getValue());
+
+	auto logger = std::make_shared<kristforge::Logger>(logLevel, std::cout,
+			logFileArg.isSet() ? std::optional(logFileArg.getValue()) : std::nullopt);
+
+	auto latency = std::make_shared<kristforge::LatencyStats>();
+
+	// prints a summary and exits - used when interrupted, or after --exit-after
+	auto shutdown = [logger, latency] {
+		logger->message(kristforge::LogLevel::Info, "Stopping");
+		logger->flush();
+		latency->print(std::cout);
+		exit(0);
+	};
+
+	std::thread signalThread([stopSignals, shutdown] {
+		int sig;
+		sigwait(&stopSignals, &sig);
+		shutdown();
+	});
+	signalThread.detach();
+
 	if (listDevicesArg.isSet()) {
 		printDeviceList();
 		return 0;
 	}
 
+	if (listVariantsArg.isSet()) {
+		printVariantList();
+		return 0;
+	}
+
 	// collect selected devices
 	std::vector allDevs = kristforge::getAllDevices();
 	std::vector<cl::Device> selectedDevices;
@@ -135,91 +191,207 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
+	// init state
+	// the journal only matches if the prefix and nonce base are the same after a restart, so the node ID must be too
+	std::uint32_t nodeID = nodeIDArg.isSet() ? nodeIDArg.getValue() : kristforge::deriveNodeID(!journalArg.isSet());
+
+	if (journalArg.isSet() && !nodeIDArg.isSet()) {
+		logger->message(kristforge::LogLevel::Warning, "--journal without --node-id derives the node ID from the host "
+		                                               "name alone - give concurrent instances on this host distinct node IDs");
+	}
+
+	std::shared_ptr<kristforge::State> state = std::make_shared<kristforge::State>(addressArg.getValue(), nodeID);
+	std::cout << "Using node ID " << nodeID << std::endl;
+	if (journalArg.isSet()) state->nonces.useJournal(journalArg.getValue());
+
 	// create miners using selected devices
 	std::vector<kristforge::Miner> miners;
 
 	for (const cl::Device &d : selectedDevices) {
 		kristforge::MinerOptions opts(
-				generatePrefix(), // prefix
+				state->nonces.prefix(), // prefix
 				worksizeArg.isSet() ? std::optional(worksizeArg.getValue()) : std::nullopt,
 				vecsizeArg.isSet() ? std::optional(vecsizeArg.getValue()) : std::nullopt,
-				clCompilerArg.getValue());
+				clCompilerArg.getValue(),
+				variantArg.isSet() ? std::optional(variantArg.getValue()) : std::nullopt,
+				noncesPerItemArg.isSet() ? std::optional(noncesPerItemArg.getValue()) : std::nullopt,
+				logger);
 
 		kristforge::Miner m(d, opts);
 		miners.push_back(m);
 		std::cout << "Created miner: " << m << std::endl;
 	}
 
-	// run tests
-	for (kristforge::Miner &m : miners) {
-		m.runTests();
-	}
+	// run tests - only the initial kernel variants are built here, faster ones are looked for once mining
+	auto runTests = [&miners, logger] {
+		for (kristforge::Miner &m : miners) {
+			m.runTests();
 
-	std::cout << "Tests completed successfully" << std::endl;
-	if (onlyTestArg.isSet()) return 0;
+			std::ostringstream msg;
+			msg << "Using kernel variant " << m.variant() << " for " << m;
+			logger->message(kristforge::LogLevel::Info, msg.str());
+		}
 
-	// init state
-	std::shared_ptr<kristforge::State> state = std::make_shared<kristforge::State>(addressArg.getValue());
+		logger->message(kristforge::LogLevel::Info, "Tests completed successfully");
+	};
 
-	// start miners
-	for (kristforge::Miner &m : miners) {
-		std::thread t([&m, state] {
-			m.run(state);
-		});
-		t.detach();
+	if (onlyTestArg.isSet()) {
+		runTests();
+		logger->flush();
+		return 0;
 	}
 
-	// thread to show status
-	std::thread status([&, state] {
-		while (!state->isStopped()) {
-			long completed = state->hashesCompleted;
-			std::this_thread::sleep_for(std::chrono::seconds(3));
-			std::cout << formatHashrate((state->hashesCompleted - completed) / 3) << std::endl;
+	auto startMiners = [&, state, logger](bool tuneFirst) {
+		runTests();
+
+		// pick the fastest kernel variants now rather than in the background once mining
+		if (tuneFirst) {
+			for (kristforge::Miner &m : miners) m.tune();
 		}
-	});
-	status.detach();
+
+		if (schedulerThreadsArg.isSet() || schedulerCPUArg.isSet()) {
+			std::vector<kristforge::Miner *> scheduled;
+			for (kristforge::Miner &m : miners) scheduled.push_back(&m);
+
+			unsigned int threads = std::max(1u, schedulerThreadsArg.getValue());
+			std::optional<unsigned int> firstCPU = schedulerCPUArg.isSet() ? std::optional(schedulerCPUArg.getValue()) : std::nullopt;
+
+			std::thread t([scheduled, state, logger, threads, firstCPU] {
+				kristforge::Scheduler(scheduled, state, logger).run(threads, firstCPU);
+			});
+			t.detach();
+		} else {
+			for (kristforge::Miner &m : miners) {
+				std::thread t([&m, state] {
+					m.run(state);
+				});
+				t.detach();
+			}
+		}
+
+		// control socket for adjusting miners at runtime
+		if (controlSocketArg.isSet()) {
+			std::vector<kristforge::Miner *> controlled;
+			for (kristforge::Miner &m : miners) controlled.push_back(&m);
+
+			auto server = std::make_shared<kristforge::ControlServer>(controlSocketArg.getValue(), controlled, state, latency);
+			std::thread t([server] { server->run(); });
+			t.detach();
+		}
+
+		// thread to log hashrate samples
+		std::thread status([&, state, logger] {
+			std::vector<long> shares(miners.size());
+			std::vector<std::string> variants(miners.size());
+			for (size_t i = 0; i < miners.size(); i++) variants[i] = miners[i].variant();
+
+			while (!state->isStopped()) {
+				long completed = state->hashesCompleted;
+				for (size_t i = 0; i < miners.size(); i++) shares[i] = miners[i].stats()->shares;
+
+				std::this_thread::sleep_for(std::chrono::seconds(3));
+				logger->hashrate((state->hashesCompleted - completed) / 3, state->solutionsStale, state->solutionsInvalid);
+
+				for (size_t i = 0; i < miners.size(); i++) {
+					// compare the rate of near misses with what the claimed hashrate should produce
+					auto stats = miners[i].stats();
+					long effective = static_cast<long>(stats->effectiveHashes(stats->shares - shares[i]) / 3);
+
+					logger->deviceHashrate(miners[i].name(), effective);
+
+					// report kernels swapped in by background tuning
+					std::string variant = miners[i].variant();
+
+					if (variant != variants[i]) {
+						logger->message(kristforge::LogLevel::Info, "Switched " + miners[i].name() + " to kernel variant " + variant);
+						variants[i] = variant;
+					}
+				}
+			}
+		});
+		status.detach();
+	};
+
+	if (replayArg.isSet()) {
+		// tune before the trace starts, so that benchmarks don't compete with it or swap kernels partway through
+		startMiners(true);
+
+		auto start = std::chrono::steady_clock::now();
+		long discarded = kristforge::trace::replay(replayArg.getValue(), state, replaySpeedArg.getValue());
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		state->stop();
+		logger->flush();
+		std::cout << "Replay finished - " << state->hashesCompleted << " hashes in " << elapsed.count() << "s ("
+		          << formatHashrate(static_cast<long>(state->hashesCompleted / elapsed.count())) << "), "
+		          << discarded << " solution(s) discarded" << std::endl;
+
+		// miner, status and control threads are still running and refer to locals here, so exit without unwinding
+		exit(0);
+	}
 
 	// init network options and callbacks
 	kristforge::network::Options netOpts;
 	netOpts.verbose = verboseArg.getValue() >= 2;
 	netOpts.autoReconnect = true;
+	netOpts.speculative = speculativeArg.isSet();
+	netOpts.latency = latency;
+	netOpts.slowSolutionThreshold = std::chrono::milliseconds(slowSolutionArg.getValue());
+	netOpts.logger = logger;
+	if (recordArg.isSet()) netOpts.recorder = std::make_shared<kristforge::trace::Recorder>(recordArg.getValue());
+
+	netOpts.onConnect = [logger](const std::string &node) {
+		logger->connected(node);
+	};
 
-	netOpts.onConnect = [] {
-		std::cout << "Connected!" << std::endl;
+	netOpts.onDisconnect = [&state, logger](const std::string &node, bool reconnecting) {
+		logger->disconnected(node, reconnecting);
+		if (!reconnecting) state->stop();
 	};
 
-	netOpts.onDisconnect = [&state](bool reconnecting) {
-		if (reconnecting) {
-			std::cout << "Disconnected - trying to reconnect..." << std::endl;
-		} else {
-			std::cout << "Disconnected." << std::endl;
-			state->stop();
-		}
+	netOpts.onSubmitted = [logger](kristforge::Solution s) {
+		logger->submitted(s);
 	};
 
-	netOpts.onSolved = [](kristforge::Solution s, long height) {
-		std::cout << "Successfully mined block #" << height << " (nonce " << s.nonce << ")" << std::endl;
+	netOpts.onSolved = [logger](kristforge::Solution s, long height) {
+		logger->accepted(s, height);
 	};
 
-	netOpts.onRejected = [](kristforge::Solution s, const std::string &message) {
-		std::cout << "Solution (nonce " << s.nonce << ") rejected: " << message << std::endl;
+	netOpts.onRejected = [logger](kristforge::Solution s, const std::string &message) {
+		logger->rejected(s, message);
 	};
 
-	if (verboseArg.isSet()) {
-		netOpts.onSubmitted = [](kristforge::Solution s) {
-			std::cout << "Submitting solution (nonce " << s.nonce << ")" << std::endl;
-		};
-	}
+	netOpts.onSlowSolution = [logger](kristforge::Solution s) {
+		long total = kristforge::stageLatency(s, kristforge::SolutionStage::Found, kristforge::SolutionStage::Acknowledged);
+		logger->slowSolution(s, total, kristforge::describeLatency(s));
+	};
 
 	if (exitAfterArg.isSet()) {
-		std::thread exitThread([&] {
+		std::thread exitThread([&exitAfterArg, shutdown] {
 			std::this_thread::sleep_for(std::chrono::seconds(exitAfterArg.getValue()));
-			std::cout << "Stopping" << std::endl;
-			exit(0);
+			shutdown();
 		});
 		exitThread.detach();
 	}
 
+	// bring up devices while connecting to the network, rather than before
+	std::thread bringUp([&startMiners, logger] {
+		try {
+			startMiners(false);
+		} catch (const std::exception &e) {
+			logger->message(kristforge::LogLevel::Error, std::string("Unable to start miners: ") + e.what());
+			logger->flush();
+			exit(1);
+		}
+	});
+	bringUp.detach();
+
 	// run networking
-	kristforge::network::run(kristNode.getValue(), state, netOpts);
+	std::vector<std::string> nodes = kristNodes.getValue();
+	if (nodes.empty()) nodes.emplace_back("https://krist.ceriat.net/ws/start");
+
+	kristforge::network::run(nodes, state, netOpts);
+	logger->flush();
+	latency->print(std::cout);
+	exit(0);
 }
\ No newline at end of file
@@ -5,6 +5,11 @@
 
 #include <string>
 #include <numeric>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <limits>
+#include <thread>
 
 extern const char _binary_kristforge_cl_start, _binary_kristforge_cl_end;
 static const std::string clSource(&_binary_kristforge_cl_start,
@@ -62,12 +67,24 @@ long kristforge::scoreDevice(const cl::Device &dev) {
 	       dev.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR>();
 }
 
+const std::vector<kristforge::KernelVariant> &kristforge::kernelVariants() {
+	static const std::vector<KernelVariant> variants = {
+			{"bitselect", ""},
+			{"classic", "-D CH_MAJ_CLASSIC"},
+			{"rolling", "-D SCHEDULE_ROLLING"},
+			{"immediate", "-D K_IMMEDIATE"},
+			{"rolling-immediate", "-D SCHEDULE_ROLLING -D K_IMMEDIATE"},
+			{"bitalign", "-D RR_BITALIGN -D SCHEDULE_ROLLING", "cl_amd_media_ops"},
+	};
+
+	return variants;
+}
+
 kristforge::Miner::Miner(cl::Device dev, kristforge::MinerOptions opts) :
 		dev(std::move(dev)),
 		opts(std::move(opts)),
 		ctx(cl::Context(this->dev)),
-		cmd(cl::CommandQueue(this->ctx, this->dev)),
-		program(this->ctx, clSource) {}
+		cmd(cl::CommandQueue(this->ctx, this->dev)) {}
 
 unsigned short kristforge::Miner::vecsize() {
 	return opts.vecsize.value_or(dev.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR>());
@@ -80,39 +97,127 @@ size_t kristforge::Miner::worksize() {
 	return std::accumulate(sizes.begin(), sizes.end(), (size_t) 1, [](size_t a, size_t b) { return a * b; });
 }
 
+size_t kristforge::Miner::maxWorksize() {
+	std::vector<size_t> sizes = dev.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+	size_t advertised = std::accumulate(sizes.begin(), sizes.end(), (size_t) 1, [](size_t a, size_t b) { return a * b; });
+
+	return std::min(advertised, static_cast<size_t>(std::numeric_limits<long>::max()) / (vecsize() * noncesPerItem()));
+}
+
+unsigned int kristforge::Miner::noncesPerItem() {
+	// per work item overhead dominates on CPUs, while GPUs benefit more from having many work items in flight
+	unsigned int fallback = dev.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU ? 16 : 1;
+
+	// the kernel only updates the lowest two nonce characters, so one work item must not span more than 1024 nonces
+	return std::min(opts.noncesPerItem.value_or(fallback), 1024u / vecsize());
+}
+
+std::string kristforge::Miner::name() const {
+	return dev.getInfo<CL_DEVICE_NAME>().data() + std::string(" (") + uniqueID(dev).value_or("n/a") + ")";
+}
+
+std::string kristforge::Miner::variant() {
+	std::lock_guard lock(tuning->mtx);
+	return variantName;
+}
+
+cl::Program kristforge::Miner::buildProgram(const kristforge::KernelVariant &variant) {
+	cl::Program prog(ctx, clSource);
+
+	// first, get compiler options
+	std::ostringstream args;
+
+	// vector type size
+	args << "-D VECSIZE=" << vecsize() << " ";
+
+	// nonces hashed by each work item
+	args << "-D NONCES_PER_ITEM=" << noncesPerItem() << " ";
+
+	// kernel variant
+	args << variant.defines << " ";
+
+	// custom extra compiler flags
+	args << opts.extraOpts;
+
+	try {
+		prog.build(args.str().data());
+	} catch (const cl::Error &e) {
+		if (e.err() == CL_BUILD_PROGRAM_FAILURE) {
+			std::ostringstream msg;
+
+			msg << "Program build failure for " << *this << " using arguments [" << args.str() << "]:" << std::endl
+			    << prog.getBuildInfo<CL_PROGRAM_BUILD_LOG>(dev);
+
+			throw std::runtime_error(msg.str());
+		} else {
+			throw e;
+		}
+	}
+
+	return prog;
+}
+
 void kristforge::Miner::ensureProgramBuilt() {
-	if (program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(dev) == CL_BUILD_NONE) {
-		// first, get compiler options
-		std::ostringstream args;
+	if (program()) return;
 
-		// vector type size
-		args << "-D VECSIZE=" << vecsize() << " ";
+	const std::vector<KernelVariant> &variants = kernelVariants();
+	auto it = variants.begin();
 
-		// custom extra compiler flags
-		args << opts.extraOpts;
+	if (opts.variant) {
+		// variant chosen manually
+		it = std::find_if(variants.begin(), variants.end(), [&](const KernelVariant &v) {
+			return v.name == *opts.variant;
+		});
 
-		try {
-			program.build(args.str().data());
-		} catch (const cl::Error &e) {
-			if (e.err() == CL_BUILD_PROGRAM_FAILURE) {
-				std::ostringstream msg;
+		if (it == variants.end()) throw std::invalid_argument("Unknown kernel variant: " + *opts.variant);
+	}
 
-				msg << "Program build failure for " << *this << " using arguments [" << args.str() << "]:" << std::endl
-				    << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(dev);
+	cl::Program prog = buildProgram(*it);
 
-				throw std::runtime_error(msg.str());
-			} else {
-				throw e;
+	std::lock_guard lock(tuning->mtx);
+	program = prog;
+	variantName = it->name;
+}
+
+void kristforge::Miner::tune() {
+	if (opts.variant) return;
+
+	// use a separate queue, so that benchmarks don't wait on mining launches
+	cl::CommandQueue queue(ctx, dev);
+	std::string exts = dev.getInfo<CL_DEVICE_EXTENSIONS>();
+
+	std::optional<cl::Program> best;
+	std::string bestName;
+	double bestSpeed = 0;
+
+	// the device is usually mining meanwhile, so speeds are only meaningful relative to each other
+	for (const KernelVariant &v : kernelVariants()) {
+		if (v.requiredExtension && exts.find(*v.requiredExtension) == std::string::npos) continue;
+
+		try {
+			cl::Program candidate = buildProgram(v);
+			testProgram(candidate, queue);
+			double speed = benchmarkProgram(candidate, queue);
+
+			if (!best || speed > bestSpeed) {
+				best = candidate;
+				bestName = v.name;
+				bestSpeed = speed;
 			}
+		} catch (const std::exception &e) {
+			// unusable on this device - keep using the current variant, but a failed self-test may be a driver bug
+			if (opts.logger) opts.logger->message(LogLevel::Debug, "Kernel variant " + v.name + " unusable on " + name() + ": " + e.what());
 		}
 	}
-}
 
-/** Calculate the score for a given hash */
-long scoreHash(const std::string &hash) {
-	const auto *raw = reinterpret_cast<const unsigned char *>(hash.data());
+	std::lock_guard lock(tuning->mtx);
+	tuning->done = true;
 
-	return ((long)raw[5]) + (((long)raw[4]) << 8) + (((long)raw[3]) << 16) + (((long)raw[2]) << 24) + (((long) raw[1]) << 32) + (((long) raw[0]) << 40);
+	if (best && bestName != variantName) {
+		tuning->program = *best;
+		tuning->variantName = bestName;
+		tuning->ready = true;
+	}
 }
 
 /** Input strings for OpenCL tests */
@@ -121,9 +226,12 @@ const std::string testInputs[16] = {"abc", "def", "ghi", "jkl", "mno", "pqr", "s
 
 void kristforge::Miner::runTests() {
 	ensureProgramBuilt();
+	testProgram(program, cmd);
+}
 
-	cl::Kernel testDigest55(program, "testDigest55");
-	cl::Kernel testScore(program, "testScore");
+void kristforge::Miner::testProgram(const cl::Program &prog, const cl::CommandQueue &queue) {
+	cl::Kernel testDigest55(prog, "testDigest55");
+	cl::Kernel testScore(prog, "testScore");
 	int vs = vecsize();
 
 	// init data arrays
@@ -149,12 +257,12 @@ void kristforge::Miner::runTests() {
 	testScore.setArg(1, scoreOutput);
 
 	// enqueue actions
-	cmd.enqueueWriteBuffer(hashInput, CL_FALSE, 0, sizeof(hashInputData), hashInputData);
-	cmd.enqueueTask(testDigest55);
-	cmd.enqueueTask(testScore);
-	cmd.enqueueReadBuffer(hashOutput, CL_FALSE, 0, sizeof(hashOutputData), hashOutputData);
-	cmd.enqueueReadBuffer(scoreOutput, CL_FALSE, 0, sizeof(scoreOutputData), scoreOutputData);
-	cmd.finish();
+	queue.enqueueWriteBuffer(hashInput, CL_FALSE, 0, sizeof(hashInputData), hashInputData);
+	queue.enqueueTask(testDigest55);
+	queue.enqueueTask(testScore);
+	queue.enqueueReadBuffer(hashOutput, CL_FALSE, 0, sizeof(hashOutputData), hashOutputData);
+	queue.enqueueReadBuffer(scoreOutput, CL_FALSE, 0, sizeof(scoreOutputData), scoreOutputData);
+	queue.finish();
 
 	// deinterleave and verify results
 	for (int i = 0; i < vs; i++) {
@@ -165,66 +273,378 @@ void kristforge::Miner::runTests() {
 		assertEquals(expectedHash, toHex(clHash), "testDigest55 failed for input " + testInputs[i]);
 		assertEquals(scoreHash(clHash), scoreOutputData[i], "testScore failed for input " + testInputs[i] + " (hash " + expectedHash + ")");
 	}
+
+	testMiner(prog, queue);
 }
 
-void kristforge::Miner::run(std::shared_ptr<kristforge::State> state) {
-	ensureProgramBuilt();
+void kristforge::Miner::testMiner(const cl::Program &prog, const cl::CommandQueue &queue) {
+	static const std::string address = "k5ztameslf", block = "000000000000";
 
-	cl::Kernel miner(program, "kristMiner");
+	cl::Kernel miner(prog, "kristMiner");
 
-	unsigned short vs = vecsize();
-	size_t ws = worksize();
+	// a single work item at an aligned offset high enough to exercise every nonce character
+	const long span = static_cast<long>(vecsize()) * noncesPerItem();
+	const long offset = 123456789L * span;
 
-	// init buffers
+	// encode every nonce the work item should try, and find the best scoring one
+	std::vector<std::array<unsigned char, 15>> expected(span);
+	long bestScore = std::numeric_limits<long>::max();
+	size_t best = 0;
+
+	for (size_t n = 0; n < expected.size(); n++) {
+		long nonce = offset + static_cast<long>(n);
+		expected[n][0] = static_cast<unsigned char>(opts.prefix[0]);
+		expected[n][1] = static_cast<unsigned char>(opts.prefix[1]);
+		for (int i = 0; i < 13; i++) expected[n][i + 2] = static_cast<unsigned char>(((nonce >> (i * 5)) & 31) + 48);
+
+		long score = scoreNonce(address, block, expected[n].data(), 15);
+		if (score < bestScore) {
+			bestScore = score;
+			best = n;
+		}
+	}
+
+	cl::Buffer addressBuf(ctx, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, 10);
+	cl::Buffer blockBuf(ctx, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, 12);
+	cl::Buffer prefixBuf(ctx, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, 2);
+	cl::Buffer solutionBuf(ctx, CL_MEM_READ_WRITE, 15);
+	cl::Buffer sharesBuf(ctx, CL_MEM_READ_WRITE, sizeof(cl_uint));
+
+	miner.setArg(0, addressBuf);
+	miner.setArg(1, blockBuf);
+	miner.setArg(2, prefixBuf);
+	miner.setArg(3, (cl_long) offset);
+	miner.setArg(5, solutionBuf);
+	miner.setArg(6, (cl_long) 0);
+	miner.setArg(7, sharesBuf);
+
+	queue.enqueueWriteBuffer(addressBuf, CL_FALSE, 0, 10, address.data());
+	queue.enqueueWriteBuffer(blockBuf, CL_FALSE, 0, 12, block.data());
+	queue.enqueueWriteBuffer(prefixBuf, CL_FALSE, 0, 2, opts.prefix.data());
+
+	// scores are 48 bits, so every nonce passes the first work value, and only the best one passes the second
+	for (long work : {1L << 48, bestScore + 1}) {
+		unsigned char solution[15] = {0};
+		cl_uint shares = 0;
+
+		miner.setArg(4, (cl_long) work);
+		queue.enqueueWriteBuffer(solutionBuf, CL_FALSE, 0, sizeof(solution), solution);
+		queue.enqueueWriteBuffer(sharesBuf, CL_FALSE, 0, sizeof(shares), &shares);
+		queue.enqueueNDRangeKernel(miner, 0, 1);
+		queue.enqueueReadBuffer(solutionBuf, CL_FALSE, 0, sizeof(solution), solution);
+		queue.finish();
+
+		std::string found = toHex(solution, sizeof(solution));
+		auto match = std::find_if(expected.begin(), expected.end(), [&](const auto &e) {
+			return std::equal(e.begin(), e.end(), solution);
+		});
+
+		if (match == expected.end()) {
+			throw std::runtime_error("kristMiner test failed - solution " + found + " isn't a nonce it should have tried");
+		}
+
+		if (scoreNonce(address, block, solution, sizeof(solution)) >= work) {
+			throw std::runtime_error("kristMiner test failed - solution " + found + " doesn't meet the work value");
+		}
+
+		if (work == bestScore + 1 && match != expected.begin() + best) {
+			throw std::runtime_error("kristMiner test failed - solution " + found + " isn't the best scoring nonce");
+		}
+	}
+}
+
+double kristforge::Miner::benchmarkProgram(const cl::Program &prog, const cl::CommandQueue &queue) {
+	static const int maxLaunches = 8;
+	static const size_t maxWorksize = 1 << 16;
+	static const std::chrono::milliseconds budget(250);
+
+	cl::Kernel miner(prog, "kristMiner");
+
+	// the default work size can be huge, so keep each launch short - this is enough to saturate most devices
+	size_t ws = std::min(worksize(), maxWorksize);
+	long launchSize = static_cast<long>(ws * vecsize() * noncesPerItem());
+
+	// mine against an arbitrary block with zero work, so that no solutions are ever found
 	cl::Buffer addressBuf(ctx, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, 10);
 	cl::Buffer blockBuf(ctx, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, 12);
 	cl::Buffer prefixBuf(ctx, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, 2);
 	cl::Buffer solutionBuf(ctx, CL_MEM_WRITE_ONLY, 15);
 
-	// set buffer args
 	miner.setArg(0, addressBuf);
 	miner.setArg(1, blockBuf);
 	miner.setArg(2, prefixBuf);
+	cl::Buffer sharesBuf(ctx, CL_MEM_READ_WRITE, sizeof(cl_uint));
+
+	miner.setArg(4, (cl_long) 0);
 	miner.setArg(5, solutionBuf);
+	miner.setArg(6, (cl_long) 0);
+	miner.setArg(7, sharesBuf);
+
+	queue.enqueueWriteBuffer(addressBuf, CL_FALSE, 0, 10, "k5ztameslf");
+	queue.enqueueWriteBuffer(blockBuf, CL_FALSE, 0, 12, "000000000000");
+	queue.enqueueWriteBuffer(prefixBuf, CL_FALSE, 0, 2, opts.prefix.data());
+
+	// warm up once so that any lazy compilation isn't measured
+	miner.setArg(3, (cl_long) 0);
+	queue.enqueueNDRangeKernel(miner, 0, ws);
+	queue.finish();
+
+	// stop early once the time budget is spent, so slow devices and variants don't hold up startup
+	auto start = std::chrono::steady_clock::now();
+	int launches = 0;
+
+	while (launches < maxLaunches && std::chrono::steady_clock::now() - start < budget) {
+		miner.setArg(3, (cl_long) (launches * launchSize));
+		queue.enqueueNDRangeKernel(miner, 0, ws);
+		queue.finish();
+		launches++;
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return launches * launchSize / elapsed.count();
+}
+
+struct kristforge::Miner::Session {
+	std::shared_ptr<State> state;
+	cl::Kernel miner;
+
+	unsigned short vs;
+	unsigned int npi;
+	size_t ws;
+
+	/** Nonces hashed by each launch - ws * vs * npi */
+	long launchSize;
+
+	cl::Buffer addressBuf, blockBuf, prefixBuf, solutionBuf, sharesBuf;
+
+	/** Whether a target is currently being mined, its epoch, and the target itself */
+	bool active = false;
+	std::uint64_t epoch = 0;
+	std::optional<Target> target;
+
+	/** The current nonce lease, and the offset of the next launch within it */
+	NonceRange lease{0, 0};
+	cl_long offset = 0;
+
+	/** Measured hashrate of this miner, used to size nonce leases */
+	double hashrate = 0;
+
+	std::chrono::steady_clock::time_point launchStart;
+	unsigned char solutionNonce[15] = {0};
+
+	/** When the next launch may start, to limit the duty cycle */
+	std::chrono::steady_clock::time_point resumeAt;
+
+	/** Share count accumulated by the kernel, as of the last launch */
+	cl_uint shareCount = 0, lastShareCount = 0;
+};
+
+void kristforge::Miner::start(std::shared_ptr<kristforge::State> state) {
+	ensureProgramBuilt();
+
+	session = std::make_shared<Session>();
+	Session &s = *session;
+
+	s.state = std::move(state);
+	s.vs = vecsize();
+	s.npi = noncesPerItem();
+
+	// init buffers
+	s.addressBuf = cl::Buffer(ctx, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, 10);
+	s.blockBuf = cl::Buffer(ctx, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, 12);
+	s.prefixBuf = cl::Buffer(ctx, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, 2);
+	s.solutionBuf = cl::Buffer(ctx, CL_MEM_WRITE_ONLY, 15);
+	s.sharesBuf = cl::Buffer(ctx, CL_MEM_READ_WRITE, sizeof(cl_uint));
+
+	createSessionKernel();
+	setSessionWorksize(worksize());
+	cmd.enqueueFillBuffer(s.sharesBuf, (cl_uint) 0, 0, sizeof(cl_uint));
 
 	// copy address/prefix
-	cmd.enqueueWriteBuffer(addressBuf, CL_FALSE, 0, 10, state->address.data());
-	cmd.enqueueWriteBuffer(prefixBuf, CL_FALSE, 0, 2, opts.prefix.data());
+	cmd.enqueueWriteBuffer(s.addressBuf, CL_FALSE, 0, 10, s.state->address.data());
+	cmd.enqueueWriteBuffer(s.prefixBuf, CL_FALSE, 0, 2, opts.prefix.data());
 	cmd.flush();
 
-	while (!state->isStopped()) {
-		kristforge::Target target = state->getTarget();
+	// mine on the initial program straight away, and look for a faster one in the background
+	bool tuned;
+
+	{
+		std::lock_guard lock(tuning->mtx);
+		tuned = tuning->done;
+	}
+
+	if (!opts.variant && !tuned) {
+		std::thread t([this] { tune(); });
+		t.detach();
+	}
+}
+
+void kristforge::Miner::createSessionKernel() {
+	Session &s = *session;
+	s.miner = cl::Kernel(program, "kristMiner");
+
+	// set buffer args
+	s.miner.setArg(0, s.addressBuf);
+	s.miner.setArg(1, s.blockBuf);
+	s.miner.setArg(2, s.prefixBuf);
+	s.miner.setArg(5, s.solutionBuf);
+	s.miner.setArg(7, s.sharesBuf);
+
+	// the rest are normally only set when they change
+	s.miner.setArg(6, (cl_long) minerStats->shareWork);
+	if (s.target) s.miner.setArg(4, s.target->work);
+}
+
+void kristforge::Miner::adoptTunedProgram() {
+	if (!tuning->ready) return;
+
+	{
+		std::lock_guard lock(tuning->mtx);
+		program = tuning->program;
+		variantName = tuning->variantName;
+		tuning->program = cl::Program();
+		tuning->ready = false;
+	}
+
+	createSessionKernel();
+}
+
+void kristforge::Miner::setSessionWorksize(size_t ws) {
+	Session &s = *session;
+	s.ws = ws;
+	s.launchSize = static_cast<long>(s.ws * s.vs * s.npi);
+
+	// aim for around 16 shares per launch - enough to measure throughput without contending on atomics
+	auto shareWork = static_cast<long>(std::min(scoreRange, 16 * scoreRange / s.launchSize));
+	minerStats->shareWork = shareWork;
+	s.miner.setArg(6, (cl_long) shareWork);
+}
+
+void kristforge::Miner::releaseLease() {
+	Session &s = *session;
+
+	if (s.active && s.offset < s.lease.end) s.state->nonces.release(s.epoch, {s.offset, s.lease.end});
+	s.lease = {0, 0};
+	s.offset = 0;
+}
+
+std::optional<cl::Event> kristforge::Miner::launch() {
+	Session &s = *session;
+
+	if (s.state->isStopped() || minerControl->paused) {
+		releaseLease();
+		return std::nullopt;
+	}
+
+	if (std::chrono::steady_clock::now() < s.resumeAt) return std::nullopt;
+
+	// the previous launch has completed, so this is a safe point to change kernels
+	adoptTunedProgram();
+
+	// pick up work size changes - leases are aligned to the launch size, so the current one can't be finished
+	size_t ws = minerControl->worksize ? minerControl->worksize.load() : worksize();
+
+	if (ws != s.ws) {
+		releaseLease();
+		setSessionWorksize(ws);
+	}
+
+	if (!s.active || s.state->getEpoch() != s.epoch) {
+		s.target = s.state->getTargetNow(s.epoch);
+		s.active = s.target.has_value();
+		s.lease = {0, 0};
+		s.offset = 0;
+
+		if (!s.target) return std::nullopt;
 
 		// copy block buffer, blank solution buffer
-		cmd.enqueueWriteBuffer(blockBuf, CL_FALSE, 0, 12, target.prevBlock.data());
-		cmd.enqueueFillBuffer(solutionBuf, (cl_uchar) 0, 0, 15);
-		cmd.flush();
+		cmd.enqueueWriteBuffer(s.blockBuf, CL_FALSE, 0, 12, s.target->prevBlockData);
+		cmd.enqueueFillBuffer(s.solutionBuf, (cl_uchar) 0, 0, 15);
 
 		// set work
-		miner.setArg(4, target.work);
+		s.miner.setArg(4, s.target->work);
+	}
 
-		unsigned char solutionNonce[15] = {0};
+	if (s.offset >= s.lease.end) {
+		s.lease = s.state->nonces.acquire(s.epoch, s.target->prevBlock(), s.target->work, s.hashrate, s.launchSize,
+		                                  s.vs * s.npi);
+		s.offset = s.lease.start;
 
-		for (cl_long offset = 1; state->getTargetNow() == target; offset += ws * vs) {
-			// set offset
-			miner.setArg(3, offset);
+		// the target changed while acquiring the lease
+		if (s.lease.size() == 0) {
+			s.active = false;
+			return std::nullopt;
+		}
+	}
 
-			// run kernel and get results
-			cmd.enqueueNDRangeKernel(miner, 0, ws);
-			cmd.enqueueReadBuffer(solutionBuf, CL_FALSE, 0, 15, solutionNonce);
-			cmd.finish();
+	s.launchStart = std::chrono::steady_clock::now();
 
-			if (solutionNonce[0] != 0) {
-				// submit solution
-				kristforge::Solution solution(target, state->address, mkString(solutionNonce, 15));
-				state->pushSolution(solution);
+	// set offset
+	s.miner.setArg(3, s.offset);
 
-				// clear solution buffer
-				cmd.enqueueFillBuffer(solutionBuf, (cl_uchar) 0, 0, 15);
-				cmd.flush();
-			}
+	// run kernel and read back results
+	cl::Event done;
+	cmd.enqueueNDRangeKernel(s.miner, 0, s.ws);
+	cmd.enqueueReadBuffer(s.sharesBuf, CL_FALSE, 0, sizeof(cl_uint), &s.shareCount);
+	cmd.enqueueReadBuffer(s.solutionBuf, CL_FALSE, 0, 15, s.solutionNonce, nullptr, &done);
+	cmd.flush();
+
+	return done;
+}
+
+void kristforge::Miner::complete(std::chrono::steady_clock::time_point finished) {
+	Session &s = *session;
+
+	if (s.solutionNonce[0] != 0) {
+		// submit solution
+		s.state->pushSolution(s.epoch, s.target->prevBlock(), s.solutionNonce, finished);
+
+		// clear solution buffer
+		cmd.enqueueFillBuffer(s.solutionBuf, (cl_uchar) 0, 0, 15);
+		cmd.flush();
+	}
+
+	s.state->hashesCompleted += s.launchSize;
+	s.offset += s.launchSize;
+
+	// the kernel accumulates shares, so unsigned wraparound still gives the right difference
+	minerStats->hashes += s.launchSize;
+	minerStats->shares += static_cast<cl_uint>(s.shareCount - s.lastShareCount);
+	s.lastShareCount = s.shareCount;
+
+	// update hashrate estimate used to size leases
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - s.launchStart;
+	double launchRate = s.launchSize / elapsed.count();
+	s.hashrate = s.hashrate == 0 ? launchRate : s.hashrate * 0.9 + launchRate * 0.1;
 
-			state->hashesCompleted += ws * vs;
+	// rest in proportion to the time spent running, to limit the duty cycle
+	int duty = std::clamp(minerControl->dutyCycle.load(), 1, 100);
+	s.resumeAt = std::chrono::steady_clock::now() +
+	             std::chrono::duration_cast<std::chrono::steady_clock::duration>(elapsed * (100 - duty) / duty);
+}
+
+void kristforge::Miner::waitForWork() {
+	Session &s = *session;
+
+	if (minerControl->paused) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	} else if (std::chrono::steady_clock::now() < s.resumeAt) {
+		std::this_thread::sleep_until(s.resumeAt);
+	} else {
+		// wait until there's a target to mine
+		s.state->getTarget();
+	}
+}
+
+void kristforge::Miner::run(std::shared_ptr<kristforge::State> state) {
+	start(state);
+
+	while (!state->isStopped()) {
+		if (std::optional<cl::Event> done = launch()) {
+			done->wait();
+			complete(std::chrono::steady_clock::now());
+		} else {
+			waitForWork();
 		}
 	}
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "state.h"
+#include "logger.h"
 
 #define __CL_ENABLE_EXCEPTIONS
 
@@ -8,6 +9,8 @@
 #include <memory>
 #include <optional>
 #include <iostream>
+#include <atomic>
+#include <mutex>
 
 namespace kristforge {
 	/** Get all standard OpenCL devices from all platforms */
@@ -19,18 +22,74 @@ namespace kristforge {
 	/** Calculate a score for this device, estimating how effective it will be for mining - higher is better */
 	long scoreDevice(const cl::Device &dev);
 
+	/** A formulation of the mining kernel, selected using preprocessor definitions when building the program */
+	struct KernelVariant {
+		/** Name used to select this variant */
+		std::string name;
+
+		/** Extra compiler options which select this variant */
+		std::string defines;
+
+		/** OpenCL extension the device must support to use this variant, if any */
+		std::optional<std::string> requiredExtension;
+	};
+
+	/** Get all known kernel variants - the first is the generic one, usable on every device */
+	const std::vector<KernelVariant> &kernelVariants();
+
+	/** Scores are 48 bits, so a hash has a (work / 2^48) chance of scoring below a given work value */
+	constexpr double scoreRange = 281474976710656.0;
+
+	/** Live statistics for a single miner, safe to read from any thread */
+	struct MinerStats {
+		/** Hashes the miner has claimed to evaluate */
+		std::atomic<long> hashes = 0;
+
+		/** Hashes found below the share threshold */
+		std::atomic<long> shares = 0;
+
+		/** The share threshold - each hash evaluated has a (shareWork / 2^48) chance of being a share */
+		std::atomic<long> shareWork = 0;
+
+		/** Estimate the number of hashes actually evaluated, given a number of shares observed */
+		inline double effectiveHashes(long observedShares) const {
+			return shareWork > 0 ? observedShares * scoreRange / shareWork : 0;
+		}
+	};
+
+	/** Runtime settings for a single miner, which it picks up between launches - safe to change from any thread */
+	struct MinerControl {
+		/** Global work size to use instead of the configured one, or 0 to use the configured one */
+		std::atomic<size_t> worksize = 0;
+
+		/** Percentage of time to spend running kernels, from 1 to 100 */
+		std::atomic<int> dutyCycle = 100;
+
+		/** If set, the miner stops launching kernels, without losing its target */
+		std::atomic<bool> paused = false;
+	};
+
 	/** Options for a specific miner */
 	struct MinerOptions {
 	public:
 		explicit MinerOptions(std::string prefix,
 		                      std::optional<size_t> worksize = std::nullopt,
 		                      std::optional<unsigned short> vecsize = std::nullopt,
-		                      std::string extraOpts = "") :
+		                      std::string extraOpts = "",
+		                      std::optional<std::string> variant = std::nullopt,
+		                      std::optional<unsigned int> noncesPerItem = std::nullopt,
+		                      std::shared_ptr<Logger> logger = nullptr) :
 				prefix(std::move(prefix)),
 				worksize(std::move(worksize)),
 				vecsize(std::move(vecsize)),
-				extraOpts(std::move(extraOpts)) {
+				extraOpts(std::move(extraOpts)),
+				variant(std::move(variant)),
+				noncesPerItem(std::move(noncesPerItem)),
+				logger(std::move(logger)) {
 			if (this->prefix.size() != 2) throw std::range_error("Prefix length must be 2");
+
+			if (this->noncesPerItem && (*this->noncesPerItem == 0 || (*this->noncesPerItem & (*this->noncesPerItem - 1)) != 0))
+				throw std::range_error("Nonces per item must be a power of two");
 		}
 
 	private:
@@ -38,6 +97,11 @@ namespace kristforge {
 		const std::optional<size_t> worksize;
 		const std::optional<unsigned short> vecsize;
 		const std::string extraOpts;
+		const std::optional<std::string> variant;
+		const std::optional<unsigned int> noncesPerItem;
+
+		/** Used to report kernel variants rejected while tuning, if set */
+		const std::shared_ptr<Logger> logger;
 
 		friend class Miner;
 
@@ -48,7 +112,9 @@ namespace kristforge {
 		return os << "MinerOptions (prefix " << opts.prefix
 		          << " worksize " << (opts.worksize ? std::to_string(*opts.worksize) : "auto")
 		          << " vecsize " << (opts.vecsize ? std::to_string(*opts.vecsize) : "auto")
-		          << " compiler args \"" << opts.extraOpts << "\")";
+		          << " compiler args \"" << opts.extraOpts << "\""
+		          << " variant " << opts.variant.value_or("auto")
+		          << " nonces per item " << (opts.noncesPerItem ? std::to_string(*opts.noncesPerItem) : "auto") << ")";
 	}
 
 	/** An OpenCL miner */
@@ -60,25 +126,122 @@ namespace kristforge {
 		/** Runs tests to ensure mining will work properly */
 		void runTests();
 
+		/**
+		 * Benchmarks every kernel variant supported by the device, and if one passing tests is faster than the current
+		 * one, swaps to it at the next launch boundary. Blocks while benchmarking - started in the background by start
+		 * unless it has already been run. Does nothing if a variant was chosen manually.
+		 */
+		void tune();
+
 		/** Runs the miner synchronously using the given state */
 		void run(std::shared_ptr<State> state);
 
+		/** Prepares the miner to be driven by launch/complete using the given state */
+		void start(std::shared_ptr<State> state);
+
+		/**
+		 * Enqueues the next kernel launch without blocking, returning an event which completes once its results have
+		 * been read back, or nothing if there's currently no target to mine or the state has been stopped
+		 */
+		std::optional<cl::Event> launch();
+
+		/**
+		 * Processes the results of the last launch - must only be called once its event has completed. Any solution
+		 * is stamped as found at finished, the time the completion was observed.
+		 */
+		void complete(std::chrono::steady_clock::time_point finished);
+
+		/** Blocks until launching might succeed again, after launch returned nothing */
+		void waitForWork();
+
 		/** The vector size set by the miner options or OpenCL device preference */
 		unsigned short vecsize();
 
 		size_t worksize();
 
+		/** The largest work size the device advertises, capped so that the nonces hashed by a launch fit in a long */
+		size_t maxWorksize();
+
+		/**
+		 * The number of nonces each work item hashes per vector lane, set by the miner options or chosen by device
+		 * type. Always a power of two, and small enough that one work item's nonces span at most 1024 values.
+		 */
+		unsigned int noncesPerItem();
+
+		/** The name of the kernel variant in use, or an empty string if no program has been built yet */
+		std::string variant();
+
+		/** A short name for this miner's device, for status output */
+		std::string name() const;
+
+		/** Live statistics for this miner */
+		inline std::shared_ptr<const MinerStats> stats() const { return minerStats; }
+
+		/** Runtime settings for this miner */
+		inline std::shared_ptr<MinerControl> control() const { return minerControl; }
+
 	private:
 		const cl::Device dev;
 		const MinerOptions opts;
 
 		const cl::Context ctx;
 		const cl::CommandQueue cmd;
-		const cl::Program program;
+		cl::Program program;
+		std::string variantName;
+
+		/** A faster program found by tune, waiting to be swapped in at the next launch boundary */
+		struct Tuning {
+			std::mutex mtx;
+			cl::Program program;
+			std::string variantName;
+			std::atomic<bool> ready = false;
+
+			/** Whether tune has finished, so that start doesn't run it again */
+			bool done = false;
+		};
+
+		std::shared_ptr<Tuning> tuning = std::make_shared<Tuning>();
 
-		/** If the OpenCL program hasn't been built yet, build it now */
+		std::shared_ptr<MinerStats> minerStats = std::make_shared<MinerStats>();
+		std::shared_ptr<MinerControl> minerControl = std::make_shared<MinerControl>();
+
+		/** State of a running miner, kept between launches */
+		struct Session;
+		std::shared_ptr<Session> session;
+
+		/** Creates the mining kernel of the running session from the current program, and sets its arguments */
+		void createSessionKernel();
+
+		/** Swaps in the program found by tune, if there is one */
+		void adoptTunedProgram();
+
+		/** Changes the global work size of the running session */
+		void setSessionWorksize(size_t ws);
+
+		/** Gives back the unsearched part of the current nonce lease, so that another miner can finish it */
+		void releaseLease();
+
+		/**
+		 * If the OpenCL program hasn't been built yet, build the manually chosen kernel variant or the generic one now,
+		 * which is quick enough to start mining right away
+		 */
 		void ensureProgramBuilt();
 
+		/** Build the OpenCL program for the given kernel variant */
+		cl::Program buildProgram(const KernelVariant &variant);
+
+		/** Run tests against the given program on the given queue, throwing an exception if they fail */
+		void testProgram(const cl::Program &prog, const cl::CommandQueue &queue);
+
+		/**
+		 * Run the mining kernel of the given program over a single work item, checking the solutions it returns against
+		 * nonces encoded and scored on the host
+		 */
+		void testMiner(const cl::Program &prog, const cl::CommandQueue &queue);
+
+		/** Run the mining kernel of the given program on the given queue for at most 250ms, returning the measured hashes per second */
+		double benchmarkProgram(const cl::Program &prog, const cl::CommandQueue &queue);
+
 		friend std::ostream &operator<<(std::ostream &os, const Miner &m);
 	};
 
@@ -1,8 +1,17 @@
 #include "network.h"
+#include "utils.h"
 
 #include <sstream>
 #include <future>
 #include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
 #include <curlpp/cURLpp.hpp>
 #include <curlpp/Easy.hpp>
 #include <curlpp/Options.hpp>
@@ -10,6 +19,9 @@
 #include <uWS/uWS.h>
 
 std::string requestWebsocketURI(const std::string &url, bool verbose) {
+	// websocket URLs are connected to directly, which allows using simple stand-in nodes for testing
+	if (url.rfind("ws://", 0) == 0 || url.rfind("wss://", 0) == 0) return url;
+
 	curlpp::Cleanup cleanup;
 	curlpp::Easy req;
 
@@ -17,6 +29,10 @@ std::string requestWebsocketURI(const std::string &url, bool verbose) {
 	req.setOpt(new curlpp::options::Post(true));
 	req.setOpt(new curlpp::options::Verbose(verbose));
 
+	// an unresponsive node shouldn't hold up resolving the others forever
+	req.setOpt(new curlpp::options::ConnectTimeout(10));
+	req.setOpt(new curlpp::options::Timeout(30));
+
 	std::stringstream stream;
 	stream << req;
 
@@ -43,8 +59,15 @@ public:
 		std::unique_lock lock(mtx);
 		if (solution) cv.wait(lock, [&] { return !solution; });
 		solution = s;
+		solution->stamp(kristforge::SolutionStage::HandedOff);
 	};
 
+	/** Record the current time for the given stage of the current solution */
+	void stamp(kristforge::SolutionStage stage) {
+		std::lock_guard lock(mtx);
+		if (solution) solution->stamp(stage);
+	}
+
 	/** Gets the current solution */
 	std::optional<kristforge::Solution> getSolutionImmediately() {
 		std::lock_guard lock(mtx);
@@ -72,48 +95,425 @@ private:
 	long id = 1;
 };
 
-void kristforge::network::run(const std::string &node, const std::shared_ptr<kristforge::State> &state, Options opts) {
+/** Krist retargeting parameters, mirroring the node */
+static const double secondsPerBlock = 60, workFactor = 0.025;
+static const long minWork = 1, maxWork = 100000;
+
+/** Estimate the work value the node will set for the next block, given the time taken to mine the current one */
+long estimateNextWork(long work, double secondsSinceLastBlock) {
+	double targetWork = secondsSinceLastBlock * work / secondsPerBlock;
+	double newWork = work + (targetWork - work) * workFactor;
+	return std::lround(std::clamp(newWork, (double) minWork, (double) maxWork));
+}
+
+/** Tracks the target predicted from one of our own solutions, until the node confirms or refutes it */
+class Speculation {
+public:
+	/** What was being speculated on, returned when speculation ends */
+	struct Outcome {
+		kristforge::Target previous;
+		kristforge::Target predicted;
+		std::vector<kristforge::Solution> held;
+	};
+
+	/** Notes that a node has moved to the given target, to time blocks for work estimation - only for node targets */
+	void observe(const kristforge::Target &target) {
+		std::lock_guard lock(mtx);
+
+		if (target.prevBlock() != lastBlock) {
+			lastBlock = target.prevBlock();
+			lastBlockTime = std::chrono::steady_clock::now();
+		}
+	}
+
+	/** Start speculating that the given solution will be accepted, returning the predicted next target */
+	kristforge::Target begin(const kristforge::Solution &s) {
+		std::lock_guard lock(mtx);
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - lastBlockTime;
+		// the next block's short hash is the first 12 hex digits of sha256(address + block + nonce)
+		char input[kristforge::Solution::addressLength + kristforge::Target::blockLength + kristforge::Solution::nonceLength];
+		std::memcpy(input, s.addressData, sizeof(s.addressData));
+		std::memcpy(input + sizeof(s.addressData), s.target.prevBlockData, sizeof(s.target.prevBlockData));
+		std::memcpy(input + sizeof(s.addressData) + sizeof(s.target.prevBlockData), s.nonceData, sizeof(s.nonceData));
+
+		unsigned char digest[32];
+		char nextBlock[kristforge::Target::blockLength];
+		sha256(std::string_view(input, sizeof(input)), digest);
+		toHex(digest, sizeof(nextBlock) / 2, nextBlock);
+
+		previous = s.target;
+		predicted = kristforge::Target(std::string_view(nextBlock, sizeof(nextBlock)),
+		                               estimateNextWork(s.target.work, elapsed.count()));
+		held.clear();
+
+		return *predicted;
+	}
+
+	/** Hold a solution found for the predicted target, returning false if it isn't for the predicted target */
+	bool hold(const kristforge::Solution &s) {
+		std::lock_guard lock(mtx);
+
+		if (!predicted || s.target != *predicted) return false;
+
+		held.push_back(s);
+		return true;
+	}
+
+	/** Stop speculating, returning what was being speculated on if anything */
+	std::optional<Outcome> end() {
+		std::lock_guard lock(mtx);
+
+		if (!predicted) return std::nullopt;
+
+		Outcome outcome{*previous, *predicted, std::move(held)};
+		previous.reset();
+		predicted.reset();
+		held.clear();
+
+		return outcome;
+	}
+
+private:
+	std::mutex mtx;
+	std::optional<kristforge::Target> previous, predicted;
+	std::vector<kristforge::Solution> held;
+
+	std::string lastBlock;
+	std::chrono::steady_clock::time_point lastBlockTime = std::chrono::steady_clock::now();
+};
+
+/** Connection state for a single upstream node */
+struct NodeConnection {
+	explicit NodeConnection(std::string url) : url(std::move(url)) {}
+
+	/** The node's websocket init URL, or a websocket URL to connect to directly */
+	const std::string url;
+
+	/** The open websocket, if connected */
+	uWS::WebSocket<false> *ws = nullptr;
+
+	/** Whether a connection attempt is in progress */
+	bool connecting = false;
+
+	/** Smoothed submission round trip time in milliseconds, if measured yet */
+	std::optional<double> latency;
+
+	/** ID of and time of sending the last submission sent to this node, if it hasn't replied yet */
+	std::optional<std::pair<long, std::chrono::steady_clock::time_point>> pending;
+};
+
+/** Resolves node websocket URLs on a background thread, as the HTTP request would otherwise block the event loop */
+class Resolver {
+public:
+	/** A resolved node, with either its websocket URL or the reason it couldn't be resolved */
+	struct Result {
+		NodeConnection *node;
+		std::optional<std::string> uri;
+		std::string error;
+	};
+
+	/** Start the resolver thread, calling onResolved (from that thread) whenever a result is ready */
+	Resolver(bool verbose, std::function<void()> onResolved) :
+			verbose(verbose),
+			onResolved(std::move(onResolved)),
+			worker(&Resolver::work, this) {}
+
+	Resolver(const Resolver &) = delete;
+
+	Resolver &operator=(const Resolver &) = delete;
+
+	/** Stops the resolver thread, after waiting for any request in progress */
+	~Resolver() {
+		{
+			std::lock_guard lock(mtx);
+			stopped = true;
+		}
+
+		cv.notify_all();
+		worker.join();
+	}
+
+	/** Queue a node to be resolved */
+	void request(NodeConnection *node) {
+		{
+			std::lock_guard lock(mtx);
+			requests.push_back(node);
+		}
+
+		cv.notify_all();
+	}
+
+	/** Take every result that's ready */
+	std::deque<Result> takeResults() {
+		std::lock_guard lock(mtx);
+		return std::exchange(results, {});
+	}
+
+private:
+	const bool verbose;
+	const std::function<void()> onResolved;
+
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::deque<NodeConnection *> requests;
+	std::deque<Result> results;
+	bool stopped = false;
+
+	// started last, once everything it uses is initialized
+	std::thread worker;
+
+	void work() {
+		for (;;) {
+			NodeConnection *node;
+
+			{
+				std::unique_lock lock(mtx);
+				cv.wait(lock, [&] { return stopped || !requests.empty(); });
+				if (stopped) return;
+
+				node = requests.front();
+				requests.pop_front();
+			}
+
+			// the node's url is const, so it's safe to read from this thread
+			Result result{node, std::nullopt, {}};
+
+			try {
+				result.uri = requestWebsocketURI(node->url, verbose);
+			} catch (const std::exception &e) {
+				result.error = e.what();
+			}
+
+			{
+				std::lock_guard lock(mtx);
+				results.push_back(std::move(result));
+			}
+
+			onResolved();
+		}
+	}
+};
+
+void kristforge::network::run(const std::vector<std::string> &nodes, const std::shared_ptr<kristforge::State> &state,
+                              Options opts) {
 	using namespace uWS;
 
+	if (nodes.empty()) throw std::invalid_argument("At least one node is required");
+
 	Hub hub;
-	auto *const hubClient = dynamic_cast<Group<false> *>(&hub);
+
+	// per-node connection state - never resized, as pointers are used as websocket user data
+	std::vector<std::unique_ptr<NodeConnection>> connections;
+	for (const std::string &url : nodes) connections.push_back(std::make_unique<NodeConnection>(url));
+
+	auto connectedCount = [&] {
+		return std::count_if(connections.begin(), connections.end(), [](auto &n) { return n->ws != nullptr; });
+	};
 
 	// used to synchronize submission state
 	SubmitState submit;
 
+	// replies still expected for the current submission, and the first rejection message received
+	int outstanding = 0;
+	std::optional<std::string> rejection;
+
+	// the latest block seen from any node, so that lagging nodes can't move us back
+	long bestHeight = 0;
+	std::string bestBlock;
+
+	// used to track predicted targets in speculative mode, and the epoch of the predicted target once switched to it
+	Speculation speculation;
+	std::uint64_t speculativeEpoch = 0;
+
+	// serializes target changes made here, so that a speculative switch can't overwrite a newer target from a node
+	std::mutex targetMtx;
+
+	// sets the target, recording and logging it - targetMtx must be held
+	auto setTarget = [&](const kristforge::Target &target) {
+		if (opts.recorder) opts.recorder->setTarget(target);
+		if (opts.logger) opts.logger->target(target);
+		state->setTarget(target);
+	};
+
+	// called with a target received from a node, reconciling it with any speculation
+	auto onNodeTarget = [&](const kristforge::Target &target, long height) {
+		// the same block is usually announced by every node - only the first announcement matters
+		if (height < bestHeight || (height == bestHeight && target.prevBlock() == bestBlock)) return;
+		bestHeight = height;
+		bestBlock = target.prevBlock();
+
+		std::lock_guard lock(targetMtx);
+		std::optional<Speculation::Outcome> outcome = speculation.end();
+
+		// blocks are only timed from node targets, as speculative switches and rollbacks would skew work estimates
+		speculation.observe(target);
+		if (state->getTargetNow() != target) setTarget(target);
+
+		// if the prediction was wrong, any work done on it is worthless
+		if (!outcome || outcome->predicted.prevBlock() != target.prevBlock()) return;
+
+		// otherwise, requeue held solutions - those which don't satisfy the real work value are discarded when popped
+		std::uint64_t epoch = state->getEpoch();
+
+		for (const kristforge::Solution &s : outcome->held) {
+			state->pushSolution(epoch, s.target.prevBlock(), reinterpret_cast<const unsigned char *>(s.nonceData),
+			                    s.timestamp(SolutionStage::Found));
+		}
+	};
+
+	// called once the current submission has been accepted, rejected by every node, or lost
+	auto finishSubmission = [&](const Json::Value *accepted) {
+		if (!submit.getSolutionImmediately()) return;
+
+		// only a real reply acknowledges the solution - one that was never sent or lost with every node isn't timed
+		bool replied = accepted || rejection;
+		if (replied) submit.stamp(SolutionStage::Acknowledged);
+		Solution acknowledged = *submit.getSolutionImmediately();
+
+		if (replied && opts.latency) opts.latency->record(acknowledged);
+
+		if (replied && opts.onSlowSolution && opts.slowSolutionThreshold &&
+		    stageLatency(acknowledged, SolutionStage::Found, SolutionStage::Acknowledged) >
+		    std::chrono::duration_cast<std::chrono::microseconds>(*opts.slowSolutionThreshold).count()) {
+			(*opts.onSlowSolution)(acknowledged);
+		}
+
+		if (accepted) {
+			const Json::Value &root = *accepted;
+			if (opts.recorder) opts.recorder->accepted(acknowledged, root["block"]["height"].asInt64());
+			if (opts.onSolved) (*opts.onSolved)(acknowledged, root["block"]["height"].asInt64());
+			onNodeTarget(kristforge::Target(root["block"]["short_hash"].asString(), root["work"].asInt64()),
+			             root["block"]["height"].asInt64());
+		} else {
+			if (opts.recorder) opts.recorder->rejected(acknowledged);
+			if (opts.onRejected) (*opts.onRejected)(acknowledged, rejection.value_or("no node replied"));
+
+			// go back to the target we were on, unless the target has changed since switching to the prediction
+			std::lock_guard lock(targetMtx);
+
+			if (std::optional<Speculation::Outcome> outcome = speculation.end()) {
+				if (state->getEpoch() == speculativeEpoch) setTarget(outcome->previous);
+			}
+		}
+
+		outstanding = 0;
+		rejection.reset();
+		submit.removeSolution();
+	};
+
+	// connection attempts that fail are retried by the reconnect timer, if enabled
+	auto connectFailed = [&](NodeConnection &n, std::string_view error) {
+		n.connecting = false;
+		if (opts.logger) opts.logger->connectError(n.url, error);
+	};
+
+	// node URLs are resolved off the event loop, with the results handed back through an Async
+	std::function<void(uS::Async *)> onResolved;
+
+	uS::Async resolvedAsync(hub.getLoop());
+	resolvedAsync.setData(&onResolved);
+	resolvedAsync.start([](uS::Async *a) { (*reinterpret_cast<std::function<void(uS::Async *)> *>(a->getData()))(a); });
+
+	Resolver resolver(opts.verbose, [&] { resolvedAsync.send(); });
+
+	onResolved = [&](uS::Async *a) {
+		for (Resolver::Result &result : resolver.takeResults()) {
+			NodeConnection &n = *result.node;
+
+			if (!result.uri) {
+				connectFailed(n, result.error);
+				continue;
+			}
+
+			try {
+				hub.connect(*result.uri, &n);
+			} catch (const std::exception &e) {
+				connectFailed(n, e.what());
+			}
+		}
+	};
+
+	auto connect = [&](NodeConnection &n) {
+		n.connecting = true;
+		resolver.request(&n);
+	};
+
 	hub.onConnection([&](WebSocket<false> *ws, const HttpRequest &req) {
-		if (opts.onConnect) (*opts.onConnect)();
+		auto &n = *static_cast<NodeConnection *>(ws->getUserData());
+		n.ws = ws;
+		n.connecting = false;
+
+		if (opts.onConnect) (*opts.onConnect)(n.url);
+	});
+
+	// uWS doesn't say why a websocket connection failed - usually it was refused, or the node is unreachable
+	hub.onError([&](void *user) {
+		connectFailed(*static_cast<NodeConnection *>(user), "websocket connection failed");
 	});
 
 	hub.onDisconnection([&](WebSocket<false> *ws, int code, char *msg, size_t length) {
-		state->unsetTarget();
-		submit.removeSolution();
-		if (opts.onDisconnect) (*opts.onDisconnect)(opts.autoReconnect);
-		if (opts.autoReconnect) hub.connect(requestWebsocketURI(node, opts.verbose));
+		auto &n = *static_cast<NodeConnection *>(ws->getUserData());
+		n.ws = nullptr;
+
+		// this node won't reply to the current submission any more
+		if (n.pending) {
+			bool current = n.pending->first == submit.getID();
+			n.pending.reset();
+			if (current && --outstanding == 0) finishSubmission(nullptr);
+		}
+
+		if (opts.onDisconnect) (*opts.onDisconnect)(n.url, opts.autoReconnect);
+
+		// only stop mining once there are no nodes left to take targets from
+		if (connectedCount() == 0) {
+			std::lock_guard lock(targetMtx);
+			if (opts.recorder) opts.recorder->unsetTarget();
+			if (opts.logger) opts.logger->noTarget();
+			speculation.end();
+			state->unsetTarget();
+			submit.removeSolution();
+			bestHeight = 0;
+			bestBlock.clear();
+		}
+
+		if (opts.autoReconnect) connect(n);
 	});
 
 	hub.onMessage([&](WebSocket<false> *ws, char *msg, size_t length, OpCode op) {
-		if (opts.verbose) std::cout << std::string(msg, length) << std::endl;
+		auto &n = *static_cast<NodeConnection *>(ws->getUserData());
+
+		if (opts.verbose && opts.logger) opts.logger->raw(n.url, std::string_view(msg, length));
 
 		Json::Value root;
 		std::istringstream(std::string(msg, length)) >> root;
 
-		if (root["id"].isNumeric() && root["id"].asInt64() == submit.getID()) {
-			// block submission reply - contains mining info
-			if (root["ok"].asBool()) {
-				if (opts.onSolved) (*opts.onSolved)(*submit.getSolutionImmediately(), root["block"]["height"].asInt64());
-				state->setTarget(kristforge::Target(root["block"]["short_hash"].asString(), root["work"].asInt64()));
-			} else {
-				if (opts.onRejected) (*opts.onRejected)(*submit.getSolutionImmediately(), root["error"].asString());
+		if (root["id"].isNumeric()) {
+			// submission reply - update this node's latency score, even if another node already won the race
+			if (n.pending && n.pending->first == root["id"].asInt64()) {
+				std::chrono::duration<double, std::milli> rtt = std::chrono::steady_clock::now() - n.pending->second;
+				n.latency = n.latency ? *n.latency * 0.8 + rtt.count() * 0.2 : rtt.count();
+				n.pending.reset();
+				if (root["id"].asInt64() == submit.getID()) outstanding--;
 			}
 
-			submit.removeSolution();
+			// only replies to the current submission matter, and the first acceptance wins
+			if (root["id"].asInt64() == submit.getID()) {
+				if (root["ok"].asBool()) {
+					finishSubmission(&root);
+				} else {
+					if (!rejection) rejection = root["error"].asString();
+					if (outstanding <= 0) finishSubmission(nullptr);
+				}
+			}
 		} else if (root["type"] == "hello") {
 			// hello packet - sent on first connect, contains mining info
-			state->setTarget(kristforge::Target(root["last_block"]["short_hash"].asString(), root["work"].asInt64()));
+			onNodeTarget(kristforge::Target(root["last_block"]["short_hash"].asString(), root["work"].asInt64()),
+			             root["last_block"]["height"].asInt64());
 		} else if (root["type"] == "event" && root["event"] == "block") {
 			// block event - sent when any block is mined, contains mining info
-			state->setTarget(kristforge::Target(root["block"]["short_hash"].asString(), root["new_work"].asInt64()));
+			onNodeTarget(kristforge::Target(root["block"]["short_hash"].asString(), root["new_work"].asInt64()),
+			             root["block"]["height"].asInt64());
 		}
 	});
 
@@ -128,13 +528,36 @@ void kristforge::network::run(const std::string &node, const std::shared_ptr<kri
 		Json::Value root;
 		root["type"] = "submit_block";
 		root["id"] = submit.getID();
-		root["address"] = solution->address;
-		root["nonce"] = solution->nonce;
+		root["address"] = Json::Value(solution->addressData, solution->addressData + sizeof(solution->addressData));
+		root["nonce"] = Json::Value(solution->nonceData, solution->nonceData + sizeof(solution->nonceData));
 
 		std::ostringstream ss;
 		writer->write(root, &ss);
+		std::string message = ss.str();
+
+		// race the submission across every connected node, fastest first
+		std::vector<NodeConnection *> targets;
 
-		hubClient->broadcast(ss.str().data(), ss.str().size(), TEXT);
+		for (auto &n : connections) {
+			if (n->ws) targets.push_back(n.get());
+		}
+
+		std::sort(targets.begin(), targets.end(), [](NodeConnection *a, NodeConnection *b) {
+			return a->latency.value_or(0) < b->latency.value_or(0);
+		});
+
+		if (targets.empty()) {
+			finishSubmission(nullptr);
+			return;
+		}
+
+		for (NodeConnection *n : targets) {
+			n->ws->send(message.data(), message.size(), TEXT);
+			n->pending = std::make_pair(submit.getID(), std::chrono::steady_clock::now());
+		}
+
+		outstanding = static_cast<int>(targets.size());
+		submit.stamp(SolutionStage::Sent);
 
 		if (opts.onSubmitted) (*opts.onSubmitted)(*solution);
 	};
@@ -143,15 +566,48 @@ void kristforge::network::run(const std::string &node, const std::shared_ptr<kri
 	solutionAsync.setData(&onSolution);
 	solutionAsync.start([](uS::Async *a) { (*reinterpret_cast<std::function<void(uS::Async *)> *>(a->getData()))(a); });
 
+	// retry nodes that couldn't be connected to, using a timer so the event loop isn't blocked
+	std::function<void()> reconnect = [&] {
+		for (auto &n : connections) {
+			if (!n->ws && !n->connecting) connect(*n);
+		}
+	};
+
+	uS::Timer reconnectTimer(hub.getLoop());
+	reconnectTimer.setData(&reconnect);
+
+	if (opts.autoReconnect) {
+		reconnectTimer.start([](uS::Timer *t) { (*reinterpret_cast<std::function<void()> *>(t->getData()))(); },
+		                     1000, 1000);
+	}
+
 	// start a new thread that triggers the Async
 	std::thread solutionChecker([&] {
-		while (!state->isStopped()) {
-			submit.setSolution(state->popSolution());
+		while (std::optional<kristforge::Solution> popped = state->popSolution()) {
+			kristforge::Solution solution = *popped;
+
+			// solutions for a predicted target can't be submitted until the node confirms the prediction
+			if (opts.speculative && speculation.hold(solution)) continue;
+
+			submit.setSolution(solution);
+
+			// handing off can block for a whole round trip, during which a node may have moved to a new block - only
+			// speculate if the solution's target is still the current one
+			if (opts.speculative) {
+				std::lock_guard lock(targetMtx);
+
+				if (state->getTargetNow() == solution.target) {
+					setTarget(speculation.begin(solution));
+					speculativeEpoch = state->getEpoch();
+				}
+			}
+
 			solutionAsync.send();
 		}
 	});
 
-	hub.connect(requestWebsocketURI(node, opts.verbose));
+	for (auto &n : connections) connect(*n);
+
 	hub.run();
 	solutionChecker.join();
 }
@@ -1,9 +1,14 @@
 #pragma once
 
 #include "state.h"
+#include "trace.h"
+#include "latency.h"
+#include "logger.h"
 
 #include <memory>
 #include <functional>
+#include <chrono>
+#include <vector>
 
 namespace kristforge::network {
 	/** Extra options for the network runner */
@@ -11,13 +16,32 @@ namespace kristforge::network {
 		/** If set, will automatically attempt to reconnect if connection is dropped */
 		bool autoReconnect = false;
 
+		/** If set along with logger, every raw message received from a node is logged at debug level */
 		bool verbose = false;
 
-		/** A callback for when a connection is successfully established (or reestablished) */
-		std::optional<std::function<void()>> onConnect;
+		/**
+		 * If set, miners switch to the block predicted from our own solution as soon as it's submitted, rather than
+		 * waiting for the node to reply. Solutions for the predicted block are held until the node confirms it.
+		 */
+		bool speculative = false;
 
-		/** A callback for when a connection is disconnected - parameter is true if a reconnection is being attempted */
-		std::optional<std::function<void(bool)>> onDisconnect;
+		/** If set, all target changes and submission replies are recorded to this trace */
+		std::shared_ptr<trace::Recorder> recorder;
+
+		/** If set, target changes and connection errors are logged here */
+		std::shared_ptr<Logger> logger;
+
+		/** If set, the latency of each stage of every acknowledged solution is recorded here */
+		std::shared_ptr<LatencyStats> latency;
+
+		/** If set, solutions taking longer than this from being found to being acknowledged are passed to onSlowSolution */
+		std::optional<std::chrono::milliseconds> slowSolutionThreshold;
+
+		/** A callback for when a connection to a node is successfully established (or reestablished) */
+		std::optional<std::function<void(const std::string &node)>> onConnect;
+
+		/** A callback for when a node is disconnected - second parameter is true if a reconnection is being attempted */
+		std::optional<std::function<void(const std::string &node, bool)>> onDisconnect;
 
 		/** A callback for when a solution is submitted */
 		std::optional<std::function<void(kristforge::Solution)>> onSubmitted;
@@ -27,8 +51,15 @@ namespace kristforge::network {
 
 		/** A callback for when a solution is rejected - second param is error message */
 		std::optional<std::function<void(kristforge::Solution, const std::string &message)>> onRejected;
+
+		/** A callback for when a solution took longer than slowSolutionThreshold to be acknowledged */
+		std::optional<std::function<void(kristforge::Solution)>> onSlowSolution;
 	};
 
-	/** Connects to the node and synchronously sets mining target and submits solutions */
-	void run(const std::string &node, const std::shared_ptr<State> &state, Options opts = Options());
+	/**
+	 * Connects to the given nodes and synchronously sets mining target and submits solutions. Targets are taken from
+	 * whichever node announces them first, and solutions are submitted to every connected node at once, with the
+	 * first acceptance winning. Nodes may be given as websocket init URLs, or as ws:// URLs to connect to directly.
+	 */
+	void run(const std::vector<std::string> &nodes, const std::shared_ptr<State> &state, Options opts = Options());
 }
\ No newline at end of file
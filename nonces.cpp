@@ -0,0 +1,187 @@
+#include "nonces.h"
+
+#include <stdexcept>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/** Identifies journal files, and their layout version */
+static const char journalMagic[4] = {'K', 'F', 'J', '1'};
+
+/** Number of bits of the nonce offset reserved for each node */
+static const int nodeBits = 47;
+
+kristforge::NonceJournal::NonceJournal() : memory(sizeof(Header) + capacity * sizeof(Entry)) {
+	header = reinterpret_cast<Header *>(memory.data());
+	entries = reinterpret_cast<Entry *>(memory.data() + sizeof(Header));
+
+	std::memcpy(header->magic, journalMagic, sizeof(journalMagic));
+	header->count = capacity;
+}
+
+kristforge::NonceJournal::NonceJournal(const std::string &path) : mappingSize(sizeof(Header) + capacity * sizeof(Entry)) {
+	fd = open(path.data(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0) throw std::runtime_error("Unable to open nonce journal " + path);
+
+	if (ftruncate(fd, mappingSize) != 0) {
+		close(fd);
+		throw std::runtime_error("Unable to resize nonce journal " + path);
+	}
+
+	void *mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (mapping == MAP_FAILED) {
+		close(fd);
+		throw std::runtime_error("Unable to map nonce journal " + path);
+	}
+
+	header = static_cast<Header *>(mapping);
+	entries = reinterpret_cast<Entry *>(static_cast<char *>(mapping) + sizeof(Header));
+
+	// start over if the file is new, or from an incompatible version
+	if (std::memcmp(header->magic, journalMagic, sizeof(journalMagic)) != 0 || header->count != capacity) {
+		std::memset(mapping, 0, mappingSize);
+		std::memcpy(header->magic, journalMagic, sizeof(journalMagic));
+		header->count = capacity;
+	}
+}
+
+kristforge::NonceJournal::~NonceJournal() {
+	if (fd >= 0) {
+		munmap(header, mappingSize);
+		close(fd);
+	}
+}
+
+kristforge::NonceJournal::Entry *kristforge::NonceJournal::lookup(std::string_view block, std::string_view prefix) {
+	if (block.size() != sizeof(Entry::block) || prefix.size() != sizeof(Entry::prefix)) return nullptr;
+
+	for (size_t i = 0; i < capacity; i++) {
+		Entry &e = entries[i];
+
+		if (std::memcmp(e.block, block.data(), sizeof(e.block)) == 0 &&
+		    std::memcmp(e.prefix, prefix.data(), sizeof(e.prefix)) == 0) {
+			return &e;
+		}
+	}
+
+	return nullptr;
+}
+
+std::optional<long> kristforge::NonceJournal::find(std::string_view block, long work, std::string_view prefix) {
+	Entry *e = lookup(block, prefix);
+	if (!e || e->work < work) return std::nullopt;
+
+	e->lastUsed = ++header->clock;
+	return e->cursor;
+}
+
+void kristforge::NonceJournal::record(std::string_view block, long work, std::string_view prefix, long cursor) {
+	Entry *e = lookup(block, prefix);
+
+	if (!e) {
+		if (block.size() != sizeof(Entry::block) || prefix.size() != sizeof(Entry::prefix)) return;
+
+		// replace the least recently used entry
+		e = std::min_element(entries, entries + capacity, [](const Entry &a, const Entry &b) {
+			return a.lastUsed < b.lastUsed;
+		});
+
+		std::memcpy(e->block, block.data(), sizeof(e->block));
+		std::memcpy(e->prefix, prefix.data(), sizeof(e->prefix));
+	}
+
+	e->work = work;
+	e->cursor = cursor;
+	e->lastUsed = ++header->clock;
+}
+
+kristforge::NonceAllocator::NonceAllocator(std::uint32_t nodeID) :
+		nodeID(nodeID),
+		base(static_cast<long>((nodeID >> 8) & 0xffff) << nodeBits),
+		limit(base + (1L << nodeBits) - 1),
+		cursor(base) {
+	if (nodeID > 0xffffff) throw std::range_error("Node ID must fit in 24 bits");
+}
+
+std::string kristforge::NonceAllocator::prefix() const {
+	char prefix[3];
+	snprintf(prefix, sizeof(prefix), "%02x", nodeID & 0xff);
+	return std::string(prefix);
+}
+
+void kristforge::NonceAllocator::useJournal(const std::string &path) {
+	std::lock_guard lock(mtx);
+	journal = std::make_unique<NonceJournal>(path);
+}
+
+kristforge::NonceRange kristforge::NonceAllocator::acquire(std::uint64_t leaseEpoch, std::string_view leaseBlock,
+                                                           long leaseWork, double hashrate, long granularity,
+                                                           long alignment) {
+	std::lock_guard lock(mtx);
+
+	if (leaseEpoch < epoch) return {0, 0};
+
+	if (leaseEpoch > epoch) {
+		// new target - resume from where it was left if it's been mined before, otherwise start from the beginning
+		epoch = leaseEpoch;
+		block = leaseBlock;
+		work = leaseWork;
+		released.clear();
+
+		std::optional<long> resume = journal->find(block, work, prefix());
+		cursor = resume && *resume >= base && *resume < limit ? *resume : base;
+	}
+
+	long size = std::max(granularity, static_cast<long>(hashrate) / granularity * granularity);
+
+	auto align = [&](long n) { return (n + alignment - 1) & ~(alignment - 1); };
+
+	// pick up unfinished ranges first
+	while (!released.empty()) {
+		NonceRange &r = released.back();
+		long start = std::min(align(r.start), r.end);
+		long available = (r.end - start) / granularity * granularity;
+
+		if (available == 0) {
+			// too small for a single launch - skipping these few nonces is cheaper than duplicating work
+			released.pop_back();
+			continue;
+		}
+
+		// as are the few nonces skipped to align the start
+		NonceRange lease{start, start + std::min(size, available)};
+		r.start = lease.end;
+		if (r.size() == 0) released.pop_back();
+
+		return lease;
+	}
+
+	cursor = align(cursor);
+	if (limit - cursor < size) throw std::range_error("Nonce space exhausted for current target");
+
+	NonceRange lease{cursor, cursor + size};
+	cursor = lease.end;
+	journal->record(block, work, prefix(), cursor);
+	return lease;
+}
+
+void kristforge::NonceAllocator::release(std::uint64_t leaseEpoch, kristforge::NonceRange remainder) {
+	std::lock_guard lock(mtx);
+
+	if (leaseEpoch == epoch && remainder.size() > 0) released.push_back(remainder);
+}
+
+std::uint32_t kristforge::deriveNodeID(bool includePID) {
+	char host[256] = {0};
+	gethostname(host, sizeof(host) - 1);
+
+	std::string seed(host);
+	if (includePID) seed += ":" + std::to_string(getpid());
+
+	size_t hash = std::hash<std::string>()(seed);
+	return static_cast<std::uint32_t>(hash ^ (hash >> 24) ^ (hash >> 48)) & 0xffffff;
+}
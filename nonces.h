@@ -0,0 +1,132 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <memory>
+#include <optional>
+
+namespace kristforge {
+	/** A range of nonce offsets, from start (inclusive) to end (exclusive) */
+	struct NonceRange {
+		long start;
+		long end;
+
+		/** The number of nonces in this range */
+		inline long size() const { return end - start; }
+	};
+
+	/**
+	 * Remembers how far the nonce space has been handed out for recent targets, so that a target which comes back
+	 * after a reconnect or restart isn't searched again. Keeps a fixed number of entries, replacing the least recently
+	 * used, either in memory or in a memory-mapped file.
+	 */
+	class NonceJournal {
+	public:
+		/** Number of targets remembered */
+		static constexpr size_t capacity = 64;
+
+		/** Create an in-memory journal */
+		NonceJournal();
+
+		/** Create a journal backed by the given file, which is created if it doesn't exist */
+		explicit NonceJournal(const std::string &path);
+
+		NonceJournal(const NonceJournal &) = delete;
+
+		NonceJournal &operator=(const NonceJournal &) = delete;
+
+		~NonceJournal();
+
+		/**
+		 * Get the high-water mark recorded for the given block and prefix, if the search was for the given work value
+		 * or higher - a search that found nothing below a higher work value can't find anything below a lower one
+		 */
+		std::optional<long> find(std::string_view block, long work, std::string_view prefix);
+
+		/** Record the high-water mark for the given target and prefix */
+		void record(std::string_view block, long work, std::string_view prefix, long cursor);
+
+	private:
+		struct Entry {
+			char block[12];
+			char prefix[2];
+			long work;
+			long cursor;
+			std::uint64_t lastUsed;
+		};
+
+		struct Header {
+			char magic[4];
+			std::uint32_t count;
+			std::uint64_t clock;
+		};
+
+		std::vector<char> memory;
+		int fd = -1;
+		size_t mappingSize = 0;
+
+		Header *header;
+		Entry *entries;
+
+		/** Find the entry for the given block and prefix, if any */
+		Entry *lookup(std::string_view block, std::string_view prefix);
+	};
+
+	/**
+	 * Hands out disjoint leases of the nonce space for each target, so that no two miners ever evaluate the same hash.
+	 *
+	 * Hosts are kept apart by a 24-bit node ID: the low 8 bits select the 2-character nonce prefix, and the remaining
+	 * 16 bits select the top bits of every nonce offset, leaving 2^47 nonces per target for each host. Miners within a
+	 * process share an allocator, and are given leases sized in proportion to their measured hashrate.
+	 */
+	class NonceAllocator {
+	public:
+		explicit NonceAllocator(std::uint32_t nodeID);
+
+		NonceAllocator(const NonceAllocator &) = delete;
+
+		NonceAllocator &operator=(const NonceAllocator &) = delete;
+
+		/** The 2-character nonce prefix for this node */
+		std::string prefix() const;
+
+		/** Use a journal backed by the given file instead of an in-memory one */
+		void useJournal(const std::string &path);
+
+		/**
+		 * Acquire a lease for the given target epoch, lasting roughly one second at the given hashrate. The lease size
+		 * is a multiple of granularity, which should be the number of nonces evaluated per kernel launch, and its start
+		 * is a multiple of alignment, which must be a power of two dividing granularity. Ranges released by other
+		 * miners are handed out first, and a target which has been mined before resumes from where it was left.
+		 * Returns an empty range if the epoch is outdated.
+		 */
+		NonceRange acquire(std::uint64_t epoch, std::string_view block, long work, double hashrate, long granularity,
+		                   long alignment = 1);
+
+		/** Return the unfinished remainder of a lease, so that another miner can pick it up */
+		void release(std::uint64_t epoch, NonceRange remainder);
+
+	private:
+		const std::uint32_t nodeID;
+		const long base;
+		const long limit;
+
+		std::mutex mtx;
+		std::uint64_t epoch = 0;
+		long cursor;
+		std::vector<NonceRange> released;
+
+		std::string block;
+		long work = 0;
+		std::unique_ptr<NonceJournal> journal = std::make_unique<NonceJournal>();
+	};
+
+	/**
+	 * Derive a node ID from the host name and, if includePID is set, the process ID, for use when one isn't configured.
+	 * Leaving out the process ID keeps the ID stable across restarts, but concurrent processes on a host then collide.
+	 */
+	std::uint32_t deriveNodeID(bool includePID = true);
+}
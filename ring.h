@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace kristforge {
+	/**
+	 * A bounded lock-free multi-producer/single-consumer ring buffer. Any number of threads may push concurrently,
+	 * but only one thread may pop. Elements must be trivially copyable so that pushing never allocates.
+	 */
+	template<typename T, size_t Capacity>
+	class MPSCRing {
+		static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+		static_assert(std::is_trivially_copyable_v<T>, "Elements must be trivially copyable");
+
+	public:
+		MPSCRing() {
+			for (size_t i = 0; i < Capacity; i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
+		MPSCRing(const MPSCRing &) = delete;
+
+		MPSCRing &operator=(const MPSCRing &) = delete;
+
+		/** Push an element, returning false without blocking if the ring is full - safe from any thread */
+		bool push(const T &value) {
+			size_t pos = tail.load(std::memory_order_relaxed);
+
+			for (;;) {
+				Cell &cell = cells[pos & (Capacity - 1)];
+				size_t seq = cell.sequence.load(std::memory_order_acquire);
+				auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+
+				if (diff == 0) {
+					// cell is free - try to claim it
+					if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						cell.value = value;
+						cell.sequence.store(pos + 1, std::memory_order_release);
+						return true;
+					}
+				} else if (diff < 0) {
+					// cell still holds an unconsumed element from the previous lap
+					return false;
+				} else {
+					// another producer claimed this cell first
+					pos = tail.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		/** Pop the oldest element into out, returning false if the ring is empty - only safe from the consumer */
+		bool pop(T &out) {
+			Cell &cell = cells[head & (Capacity - 1)];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+
+			if (static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(head + 1) < 0) return false;
+
+			out = cell.value;
+			cell.sequence.store(head + Capacity, std::memory_order_release);
+			head++;
+			return true;
+		}
+
+		/** Whether there's nothing to pop - only safe from the consumer */
+		bool empty() const {
+			const Cell &cell = cells[head & (Capacity - 1)];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			return static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(head + 1) < 0;
+		}
+
+	private:
+		struct Cell {
+			std::atomic<size_t> sequence;
+			T value;
+		};
+
+		Cell cells[Capacity];
+		alignas(64) std::atomic<size_t> tail = 0;
+		alignas(64) size_t head = 0;
+	};
+}
@@ -0,0 +1,141 @@
+#include "scheduler.h"
+
+#include <thread>
+#include <pthread.h>
+
+/** User data for event callbacks, identifying the device a launch belongs to */
+struct CallbackData {
+	kristforge::Scheduler *scheduler;
+	size_t index;
+};
+
+kristforge::Scheduler::Scheduler(std::vector<kristforge::Miner *> miners, std::shared_ptr<kristforge::State> state,
+                                 std::shared_ptr<kristforge::Logger> logger) :
+		state(std::move(state)), logger(std::move(logger)) {
+	for (Miner *m : miners) devices.push_back({m});
+}
+
+void kristforge::Scheduler::onComplete(cl_event event, cl_int status, void *userData) {
+	auto *data = static_cast<CallbackData *>(userData);
+	Scheduler &self = *data->scheduler;
+
+	size_t index = data->index;
+	delete data;
+
+	auto finished = std::chrono::steady_clock::now();
+
+	// a failed launch's results are garbage, so don't process them, and don't retry a device which may keep failing
+	if (status < 0 && self.logger) {
+		self.logger->message(LogLevel::Error, "Launch failed on " + self.devices[index].miner->name() +
+		                                      " (error " + std::to_string(status) + ") - stopping this device");
+	}
+
+	// notify while holding the lock - once inFlight drops to zero, run may return and destroy the scheduler
+	std::lock_guard lock(self.mtx);
+
+	if (status < 0) {
+		self.devices[index].state = DeviceState::Failed;
+	} else {
+		self.devices[index].state = DeviceState::Completed;
+		self.devices[index].finished = finished;
+		self.completed.push_back(index);
+	}
+
+	self.inFlight--;
+	self.cv.notify_all();
+}
+
+void kristforge::Scheduler::launch(size_t index) {
+	Device &d = devices[index];
+
+	if (std::optional<cl::Event> done = d.miner->launch()) {
+		{
+			std::lock_guard lock(mtx);
+			inFlight++;
+		}
+
+		done->setCallback(CL_COMPLETE, &Scheduler::onComplete, new CallbackData{this, index});
+	} else {
+		std::lock_guard lock(mtx);
+		d.state = DeviceState::Idle;
+	}
+}
+
+void kristforge::Scheduler::work() {
+	while (!state->isStopped()) {
+		std::optional<size_t> index;
+		std::chrono::steady_clock::time_point finished;
+		std::vector<size_t> idle;
+
+		{
+			std::unique_lock lock(mtx);
+
+			// idle devices are retried periodically, as there's no event for a target being set or a miner resuming
+			cv.wait_for(lock, std::chrono::milliseconds(50), [&] { return !completed.empty(); });
+
+			// claim devices while holding the lock, so that no other pool thread touches them
+			if (!completed.empty()) {
+				index = completed.front();
+				completed.pop_front();
+				devices[*index].state = DeviceState::Running;
+				finished = devices[*index].finished;
+			}
+
+			auto now = std::chrono::steady_clock::now();
+
+			if (now - lastIdleRetry >= std::chrono::milliseconds(50)) {
+				lastIdleRetry = now;
+
+				for (size_t i = 0; i < devices.size(); i++) {
+					if (devices[i].state == DeviceState::Idle) {
+						devices[i].state = DeviceState::Running;
+						idle.push_back(i);
+					}
+				}
+			}
+		}
+
+		if (index) {
+			devices[*index].miner->complete(finished);
+			launch(*index);
+		}
+
+		for (size_t i : idle) launch(i);
+	}
+}
+
+void kristforge::Scheduler::run(unsigned int threads, std::optional<unsigned int> firstCPU) {
+	// claim every device for the initial launches before any pool thread starts
+	for (Device &d : devices) {
+		d.miner->start(state);
+		d.state = DeviceState::Running;
+	}
+
+	auto pin = [&](unsigned int i) {
+		if (!firstCPU) return;
+
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(*firstCPU + i, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	};
+
+	std::vector<std::thread> pool;
+
+	for (unsigned int i = 1; i < threads; i++) {
+		pool.emplace_back([this, i, &pin] {
+			pin(i);
+			work();
+		});
+	}
+
+	pin(0);
+	for (size_t i = 0; i < devices.size(); i++) launch(i);
+	work();
+
+	for (std::thread &t : pool) t.join();
+
+	// wait for launches still in flight, as their callbacks refer to this scheduler
+	std::unique_lock lock(mtx);
+	cv.wait(lock, [&] { return inFlight == 0; });
+}
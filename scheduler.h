@@ -0,0 +1,80 @@
+#pragma once
+
+#include "miner.h"
+#include "state.h"
+#include "logger.h"
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <optional>
+#include <chrono>
+
+namespace kristforge {
+	/**
+	 * Drives many miners from a small pool of host threads, instead of one blocked thread per device. Each miner has
+	 * at most one launch in flight - its completion event pushes it onto a queue, and whichever pool thread pops it
+	 * processes the results and enqueues the next launch.
+	 */
+	class Scheduler {
+	public:
+		/** Create a scheduler for the given miners, which must outlive it, logging failed launches if logger is set */
+		Scheduler(std::vector<Miner *> miners, std::shared_ptr<State> state, std::shared_ptr<Logger> logger = nullptr);
+
+		Scheduler(const Scheduler &) = delete;
+
+		Scheduler &operator=(const Scheduler &) = delete;
+
+		/**
+		 * Runs all miners synchronously until the state is stopped, using the given number of threads (including the
+		 * calling one). If firstCPU is set, thread i is pinned to CPU firstCPU + i.
+		 */
+		void run(unsigned int threads = 1, std::optional<unsigned int> firstCPU = std::nullopt);
+
+	private:
+		/** Per-device state machine */
+		enum class DeviceState {
+			/** Waiting for a target to be set, or paused or throttled by its controls */
+			Idle,
+
+			/** Claimed by a pool thread, or a launch is in flight */
+			Running,
+
+			/** The launch has completed, and its results are waiting to be processed */
+			Completed,
+
+			/** A launch failed - the device is never launched again */
+			Failed
+		};
+
+		struct Device {
+			Miner *miner;
+			DeviceState state = DeviceState::Idle;
+
+			/** When the last launch's completion callback ran, so that solutions are timed from then */
+			std::chrono::steady_clock::time_point finished;
+		};
+
+		std::vector<Device> devices;
+		const std::shared_ptr<State> state;
+		const std::shared_ptr<Logger> logger;
+
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::deque<size_t> completed;
+
+		/** Launches whose completion callback hasn't run yet - the scheduler must not be destroyed until it's zero */
+		size_t inFlight = 0;
+		std::chrono::steady_clock::time_point lastIdleRetry;
+
+		/** Pop completed devices and relaunch them until stopped */
+		void work();
+
+		/** Try to launch the given device, which must already be claimed, returning it to idle if there's no work */
+		void launch(size_t index);
+
+		/** Event callback invoked by the OpenCL runtime when a launch completes */
+		static void onComplete(cl_event event, cl_int status, void *userData);
+	};
+}
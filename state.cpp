@@ -1,12 +1,19 @@
 #include "state.h"
+#include "utils.h"
 
 kristforge::Target kristforge::State::getTarget() {
+	std::uint64_t ignored;
+	return getTarget(ignored);
+}
+
+kristforge::Target kristforge::State::getTarget(std::uint64_t &targetEpoch) {
 	std::unique_lock<std::mutex> lock(targetMutex);
 
 	if (!target) {
 		targetCV.wait(lock, [&] { return target; });
 	}
 
+	targetEpoch = epoch;
 	return *target;
 }
 
@@ -15,14 +22,19 @@ std::optional<kristforge::Target> kristforge::State::getTargetNow() {
 	return target;
 }
 
+std::optional<kristforge::Target> kristforge::State::getTargetNow(std::uint64_t &targetEpoch) {
+	std::unique_lock<std::mutex> lock(targetMutex);
+	targetEpoch = epoch;
+	return target;
+}
+
 void kristforge::State::setTarget(kristforge::Target newTarget) {
 	std::lock_guard lock(targetMutex);
 
 	if (!target || *target != newTarget) {
 		target = newTarget;
+		epoch++;
 		targetCV.notify_all();
-
-		clearSolutions();
 	}
 }
 
@@ -31,44 +43,87 @@ void kristforge::State::unsetTarget() {
 
 	if (target) {
 		target.reset();
+		epoch++;
 		targetCV.notify_all();
-
-		clearSolutions();
 	}
 }
 
-void kristforge::State::clearSolutions() {
-	std::lock_guard lock(solutionMutex);
-	solutions = {};
-	solutionCV.notify_all();
-}
+bool kristforge::State::pushSolution(std::uint64_t solutionEpoch, std::string_view block, const unsigned char *nonce,
+                                     std::chrono::steady_clock::time_point found) {
+	SolutionRecord record{};
+	record.epoch = solutionEpoch;
+	block.copy(record.block, sizeof(record.block));
+	std::copy(nonce, nonce + sizeof(record.nonce), record.nonce);
+	record.found = found;
+	record.queued = std::chrono::steady_clock::now();
+
+	if (!solutions.push(record)) {
+		solutionsDropped++;
+		return false;
+	}
+
+	// pairs with the fence in popSolution - either the consumer sees this solution, or this sees it waiting
+	std::atomic_thread_fence(std::memory_order_seq_cst);
 
-void kristforge::State::pushSolution(const kristforge::Solution &solution) {
-	std::lock_guard lock(solutionMutex);
-	solutions.push(solution);
-	solutionCV.notify_all();
+	// only one producer gets to wake the consumer - any extra wakeup is harmless, as the consumer checks again
+	if (consumerWaiting.load(std::memory_order_relaxed) && consumerWaiting.exchange(false)) sem_post(&solutionSignal);
+
+	return true;
 }
 
 std::optional<kristforge::Solution> kristforge::State::popSolutionImmediately() {
-	std::lock_guard lock(solutionMutex);
-
-	if (solutions.empty()) {
-		return {};
-	} else {
-		Solution ret = solutions.front();
-		solutions.pop();
-		return ret;
+	SolutionRecord record{};
+
+	while (solutions.pop(record)) {
+		// only lock to fetch the target when the epoch changes
+		if (poppedEpoch != epoch.load(std::memory_order_acquire)) {
+			std::lock_guard lock(targetMutex);
+			poppedEpoch = epoch;
+			poppedTarget = target;
+		}
+
+		// a solution from an earlier epoch is still good if the target has come back to its block, as happens when
+		// reconnecting - the journal resumes past its range, so dropping it would lose the block for good
+		if (!poppedTarget || (record.epoch != poppedEpoch &&
+		                      std::memcmp(record.block, poppedTarget->prevBlockData, sizeof(record.block)) != 0)) {
+			solutionsStale++;
+			continue;
+		}
+
+		// the kernel may have been miscompiled, so check the hash before it costs a round trip to the node
+		if (scoreNonce(address, poppedTarget->prevBlock(), record.nonce, sizeof(record.nonce)) >= poppedTarget->work) {
+			solutionsInvalid++;
+			continue;
+		}
+
+		Solution solution(*poppedTarget, address, bytesView(record.nonce, sizeof(record.nonce)));
+		solution.timestamps[static_cast<size_t>(SolutionStage::Found)] = record.found;
+		solution.timestamps[static_cast<size_t>(SolutionStage::Queued)] = record.queued;
+		solution.stamp(SolutionStage::Popped);
+		return solution;
 	}
+
+	return std::nullopt;
 }
 
-kristforge::Solution kristforge::State::popSolution() {
-	std::unique_lock<std::mutex> lock(solutionMutex);
+std::optional<kristforge::Solution> kristforge::State::popSolution() {
+	while (!stopped) {
+		if (auto solution = popSolutionImmediately()) return solution;
 
-	if (solutions.empty()) {
-		solutionCV.wait(lock, [&] { return !solutions.empty(); });
+		consumerWaiting = true;
+
+		// pairs with the fence in pushSolution
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		// interrupted waits just go round again
+		if (solutions.empty() && !stopped) sem_wait(&solutionSignal);
+		consumerWaiting = false;
 	}
 
-	Solution ret = solutions.front();
-	solutions.pop();
-	return ret;
+	return std::nullopt;
+}
+
+void kristforge::State::stop() {
+	stopped = true;
+	sem_post(&solutionSignal);
 }
@@ -1,80 +1,176 @@
 #pragma once
 
+#include "ring.h"
+#include "nonces.h"
+
 #include <mutex>
 #include <condition_variable>
 #include <optional>
 #include <atomic>
-#include <queue>
 #include <iostream>
+#include <cstdint>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include <semaphore.h>
 
 namespace kristforge {
-	/** A target to mine for */
+	/** A target to mine for - trivially copyable, so it's passed between threads without allocating */
 	struct Target {
 	public:
-		Target(std::string prevBlock, long work) : prevBlock(std::move(prevBlock)), work(work) {
-			if (this->prevBlock.size() != 12) {
+		/** Length of a short block hash */
+		static constexpr size_t blockLength = 12;
+
+		Target(std::string_view prevBlock, long work) : work(work) {
+			if (prevBlock.size() != blockLength) {
 				throw std::range_error("Previous block length must equal 12");
 			}
+
+			std::memcpy(prevBlockData, prevBlock.data(), blockLength);
 		}
 
-		/** Short hash of the previous block */
-		std::string prevBlock;
+		/** Short hash of the previous block - not null terminated */
+		char prevBlockData[blockLength];
 
 		/** Work value */
 		long work;
 
+		/** Short hash of the previous block */
+		inline std::string_view prevBlock() const { return {prevBlockData, blockLength}; }
+
 		/** Compares two targets for equality */
-		inline bool operator==(const Target &other) const { return prevBlock == other.prevBlock && work == other.work; }
+		inline bool operator==(const Target &other) const {
+			return work == other.work && std::memcmp(prevBlockData, other.prevBlockData, blockLength) == 0;
+		}
 
 		/** Compares two targets for inequality */
-		inline bool operator!=(const Target &other) const { return prevBlock != other.prevBlock || work != other.work; }
+		inline bool operator!=(const Target &other) const { return !(*this == other); }
 	};
 
+	static_assert(std::is_trivially_copyable_v<Target>, "Targets must be trivially copyable");
+
 	inline std::ostream &operator<<(std::ostream &os, const Target &tgt) {
-		return os << "Target (block " << tgt.prevBlock << " work " << std::to_string(tgt.work) << ")";
+		return os << "Target (block " << tgt.prevBlock() << " work " << std::to_string(tgt.work) << ")";
 	}
 
-	/** A solution for a specific target */
+	/** Stages a solution passes through on its way to the node, timestamped for latency tracing */
+	enum class SolutionStage : size_t {
+		/** Kernel result read back by the miner */
+		Found,
+
+		/** Pushed onto the solution queue */
+		Queued,
+
+		/** Popped off the queue by the network side */
+		Popped,
+
+		/** Accepted into the submission slot */
+		HandedOff,
+
+		/** Sent to the node */
+		Sent,
+
+		/** Reply received from the node */
+		Acknowledged,
+
+		Count
+	};
+
+	/** Number of solution stages */
+	constexpr size_t solutionStageCount = static_cast<size_t>(SolutionStage::Count);
+
+	/** A solution for a specific target - trivially copyable, so it's passed between threads without allocating */
 	struct Solution {
 	public:
-		Solution(Target target, std::string address, std::string nonce) :
-				target(std::move(target)), address(std::move(address)), nonce(std::move(nonce)) {}
+		/** Length of a krist address */
+		static constexpr size_t addressLength = 10;
+
+		/** Length of a nonce, including the prefix */
+		static constexpr size_t nonceLength = 15;
+
+		Solution(const Target &target, std::string_view address, std::string_view nonce) : target(target) {
+			if (address.size() != addressLength) throw std::range_error("Address length must equal 10");
+			if (nonce.size() != nonceLength) throw std::range_error("Nonce length must equal 15");
+
+			std::memcpy(addressData, address.data(), addressLength);
+			std::memcpy(nonceData, nonce.data(), nonceLength);
+		}
+
+		/** Monotonic timestamps for each stage this solution has passed through - unset stages are zero */
+		std::array<std::chrono::steady_clock::time_point, solutionStageCount> timestamps{};
+
+		/** Record the current time for the given stage */
+		inline void stamp(SolutionStage stage) {
+			timestamps[static_cast<size_t>(stage)] = std::chrono::steady_clock::now();
+		}
+
+		/** Get the timestamp for the given stage */
+		inline std::chrono::steady_clock::time_point timestamp(SolutionStage stage) const {
+			return timestamps[static_cast<size_t>(stage)];
+		}
 
 		/** The target that this solution applies to */
 		Target target;
 
+		/** The address this solution is valid for - not null terminated */
+		char addressData[addressLength];
+
+		/** The nonce of this solution - not null terminated */
+		char nonceData[nonceLength];
+
 		/** The address this solution is valid for */
-		std::string address;
+		inline std::string_view address() const { return {addressData, addressLength}; }
 
 		/** The nonce of this solution */
-		std::string nonce;
+		inline std::string_view nonce() const { return {nonceData, nonceLength}; }
 
 		/** Compares two solutions for equality */
 		inline bool operator==(const Solution &other) const {
 			return target == other.target &&
-			       address == other.address &&
-			       nonce == other.nonce;
+			       std::memcmp(addressData, other.addressData, addressLength) == 0 &&
+			       std::memcmp(nonceData, other.nonceData, nonceLength) == 0;
 		}
 
 		/** Compares two solutions for inequality */
-		inline bool operator!=(const Solution &other) const {
-			return target != other.target ||
-			       address != other.address ||
-			       nonce != other.nonce;
-		}
+		inline bool operator!=(const Solution &other) const { return !(*this == other); }
 	};
 
+	static_assert(std::is_trivially_copyable_v<Solution>, "Solutions must be trivially copyable");
+
 	inline std::ostream &operator<<(std::ostream &os, const Solution &sol) {
-		return os << "Solution (address " << sol.address << " nonce " << sol.nonce << " " << sol.target << ")";
+		return os << "Solution (address " << sol.address() << " nonce " << sol.nonce() << " " << sol.target << ")";
 	}
 
+	/** A fixed-size solution as reported by a miner, tagged with the target epoch and block it was found for */
+	struct SolutionRecord {
+		/** The target epoch this solution was found during */
+		std::uint64_t epoch;
+
+		/** Short hash of the block this solution was found for - not null terminated */
+		char block[Target::blockLength];
+
+		/** The nonce of this solution (prefix + nonce) */
+		unsigned char nonce[Solution::nonceLength];
+
+		/** When the miner found this solution */
+		std::chrono::steady_clock::time_point found;
+
+		/** When this solution was queued */
+		std::chrono::steady_clock::time_point queued;
+	};
+
 	/** A shared mining state, used to synchronize mining tasks */
 	class State {
 	public:
-		explicit State(std::string address) : address(std::move(address)) {
+		explicit State(std::string address, std::uint32_t nodeID = 0) : address(std::move(address)), nonces(nodeID) {
 			if (this->address.size() != 10) throw std::range_error("Address length must be 10");
+			sem_init(&solutionSignal, 0, 0);
 		}
 
+		~State() { sem_destroy(&solutionSignal); }
+
 		State(const State &) = delete;
 
 		State &operator=(const State &) = delete;
@@ -82,29 +178,48 @@ namespace kristforge {
 		/** Gets the mining target, blocking until one is available if necessary */
 		Target getTarget();
 
+		/** Gets the mining target and its epoch, blocking until one is available if necessary */
+		Target getTarget(std::uint64_t &epoch);
+
 		/** Gets the target immediately, regardless of whether it's set or not */
 		std::optional<Target> getTargetNow();
 
+		/** Gets the target and its epoch immediately, regardless of whether it's set or not */
+		std::optional<Target> getTargetNow(std::uint64_t &epoch);
+
+		/** Gets the current target epoch, which changes whenever the target is set or unset - never blocks */
+		inline std::uint64_t getEpoch() { return epoch.load(std::memory_order_acquire); }
+
 		/** Sets the current mining target */
 		void setTarget(Target newTarget);
 
 		/** Unsets the mining target */
 		void unsetTarget();
 
-		/** Clears all queued solutions */
-		void clearSolutions();
-
-		/** Add a solution to the end of the queue */
-		void pushSolution(const Solution &solution);
-
-		/** Pops the first solution immediately, regardless of whether one's available or not */
+		/**
+		 * Queue a solution found for the given block during the given target epoch - never blocks or allocates, and is
+		 * safe to call from any number of miner threads. Returns false if the queue is full and the solution was dropped.
+		 */
+		bool pushSolution(std::uint64_t solutionEpoch, std::string_view block, const unsigned char *nonce,
+		                  std::chrono::steady_clock::time_point found = std::chrono::steady_clock::now());
+
+		/**
+		 * Pops the first solution for the current target immediately, regardless of whether one's available or not.
+		 * Solutions for stale targets, or which don't actually meet the target when hashed on the host, are discarded -
+		 * but one from an earlier epoch is kept if the target has since returned to its block.
+		 * Must only be called from a single consumer thread.
+		 */
 		std::optional<Solution> popSolutionImmediately();
 
-		/** Pops the first solution off of the queue, blocking until one is available if necessary */
-		Solution popSolution();
+		/**
+		 * Pops the first solution for the current target, blocking until one is available if necessary, or returning
+		 * nothing once the state is stopped. Solutions for stale targets, or which don't actually meet the target when
+		 * hashed on the host, are discarded. Must only be called from a single consumer thread.
+		 */
+		std::optional<Solution> popSolution();
 
 		/** Sets the stopped flag, signalling threads to exit */
-		inline void stop() { stopped = true; }
+		void stop();
 
 		/** Checks whether the stop flag is currently set */
 		inline bool isStopped() { return stopped; }
@@ -112,17 +227,37 @@ namespace kristforge {
 		/** The krist address to mine for */
 		const std::string address;
 
+		/** Allocates disjoint nonce ranges to miners */
+		NonceAllocator nonces;
+
 		/** Total hashes evaluated */
-		std::atomic<long> hashesCompleted;
+		std::atomic<long> hashesCompleted = 0;
+
+		/** Solutions discarded because the target changed after they were found */
+		std::atomic<long> solutionsStale = 0;
+
+		/** Solutions discarded because their hash didn't meet the target when verified on the host */
+		std::atomic<long> solutionsInvalid = 0;
+
+		/** Solutions dropped because the queue was full */
+		std::atomic<long> solutionsDropped = 0;
 
 	private:
 		std::mutex targetMutex;
 		std::condition_variable targetCV;
 		std::optional<Target> target;
+		std::atomic<std::uint64_t> epoch = 0;
+
+		MPSCRing<SolutionRecord, 64> solutions;
+
+		// the consumer sets consumerWaiting before sleeping on the semaphore - producers post to it without locking,
+		// so reporting a solution never blocks a miner thread
+		sem_t solutionSignal;
+		std::atomic<bool> consumerWaiting = false;
 
-		std::mutex solutionMutex;
-		std::condition_variable solutionCV;
-		std::queue<Solution> solutions;
+		// the target for the epoch solutions were last popped in - only used by the consumer
+		std::optional<Target> poppedTarget;
+		std::uint64_t poppedEpoch = 0;
 
 		std::atomic<bool> stopped = false;
 	};
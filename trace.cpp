@@ -0,0 +1,84 @@
+#include "trace.h"
+
+#include <sstream>
+#include <thread>
+
+kristforge::trace::Recorder::Recorder(const std::string &path) :
+		out(path, std::ios::out | std::ios::trunc),
+		start(std::chrono::steady_clock::now()) {
+	if (!out) throw std::runtime_error("Unable to open trace file for writing: " + path);
+}
+
+void kristforge::trace::Recorder::write(const std::string &line) {
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+	std::lock_guard lock(mtx);
+	out << elapsed.count() << " " << line << "\n";
+	out.flush();
+}
+
+void kristforge::trace::Recorder::setTarget(const kristforge::Target &target) {
+	write("T " + std::string(target.prevBlock()) + " " + std::to_string(target.work));
+}
+
+void kristforge::trace::Recorder::unsetTarget() {
+	write("U");
+}
+
+void kristforge::trace::Recorder::accepted(const kristforge::Solution &solution, long height) {
+	write("A " + std::to_string(height) + " " + std::string(solution.nonce()));
+}
+
+void kristforge::trace::Recorder::rejected(const kristforge::Solution &solution) {
+	write("R " + std::string(solution.nonce()));
+}
+
+long kristforge::trace::replay(const std::string &path, const std::shared_ptr<kristforge::State> &state, double speed) {
+	if (!(speed > 0)) throw std::invalid_argument("Replay speed must be greater than zero");
+
+	std::ifstream in(path);
+	if (!in) throw std::runtime_error("Unable to open trace file for reading: " + path);
+
+	// discard solutions, as there's no node to submit them to
+	std::atomic<long> discarded = 0;
+	std::atomic<bool> finished = false;
+
+	std::thread drain([&] {
+		while (!finished) {
+			if (state->popSolutionImmediately()) {
+				discarded++;
+			} else {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+		}
+	});
+
+	auto start = std::chrono::steady_clock::now();
+	std::string line;
+
+	while (!state->isStopped() && std::getline(in, line)) {
+		std::istringstream fields(line);
+		long ms;
+		char type;
+
+		if (!(fields >> ms >> type)) continue;
+
+		std::this_thread::sleep_until(start + std::chrono::duration<double, std::milli>(ms / speed));
+
+		if (type == 'T') {
+			std::string block;
+			long work;
+
+			if (fields >> block >> work) state->setTarget(kristforge::Target(block, work));
+		} else if (type == 'U') {
+			state->unsetTarget();
+		}
+
+		// submission replies are informational - the target changes they caused are recorded separately
+	}
+
+	finished = true;
+	drain.join();
+
+	return discarded;
+}
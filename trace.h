@@ -0,0 +1,53 @@
+#pragma once
+
+#include "state.h"
+
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <chrono>
+
+namespace kristforge::trace {
+	/**
+	 * Records network events to a trace file, one per line, each prefixed with the milliseconds elapsed since
+	 * recording started:
+	 * <ms> T <block> <work>     - target set
+	 * <ms> U                    - target unset
+	 * <ms> A <height> <nonce>   - solution accepted
+	 * <ms> R <nonce>            - solution rejected
+	 */
+	class Recorder {
+	public:
+		explicit Recorder(const std::string &path);
+
+		Recorder(const Recorder &) = delete;
+
+		Recorder &operator=(const Recorder &) = delete;
+
+		/** Record the mining target being set */
+		void setTarget(const Target &target);
+
+		/** Record the mining target being unset */
+		void unsetTarget();
+
+		/** Record a submission being accepted */
+		void accepted(const Solution &solution, long height);
+
+		/** Record a submission being rejected */
+		void rejected(const Solution &solution);
+
+	private:
+		std::mutex mtx;
+		std::ofstream out;
+		const std::chrono::steady_clock::time_point start;
+
+		/** Write a single line, prefixed with the current timestamp */
+		void write(const std::string &line);
+	};
+
+	/**
+	 * Feeds the events of a recorded trace into the given state, sleeping between events to reproduce the original
+	 * timing divided by speed. Solutions found while replaying are discarded. Returns the number discarded.
+	 */
+	long replay(const std::string &path, const std::shared_ptr<State> &state, double speed = 1);
+}
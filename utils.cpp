@@ -1,18 +1,24 @@
 #include "utils.h"
 
 #include <openssl/sha.h>
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
 
 static const char hex[] = "0123456789abcdef";
 
-/** Convert binary data to hex representation */
-std::string toHex(const unsigned char *data, size_t len) {
-	std::string output;
-
+/** Convert binary data to hex representation in place */
+void toHex(const unsigned char *data, size_t len, char *out) {
 	for (int i = 0; i < len; i++) {
-		output += hex[data[i] >> 4];
-		output += hex[data[i] & 0xf];
+		out[i * 2] = hex[data[i] >> 4];
+		out[i * 2 + 1] = hex[data[i] & 0xf];
 	}
+}
 
+/** Convert binary data to hex representation */
+std::string toHex(const unsigned char *data, size_t len) {
+	std::string output(len * 2, ' ');
+	toHex(data, len, output.data());
 	return output;
 }
 
@@ -35,8 +41,44 @@ std::string sha256hex(const std::string &data) {
 	return toHex(hashed, SHA256_DIGEST_LENGTH);
 }
 
-std::string mkString(const unsigned char *data, size_t len) {
-	std::string out(len, ' ');
-	for (int i = 0; i < len; i++) out[i] = data[i];
-	return out;
+/** Compute sha256 into a caller-provided buffer */
+void sha256(std::string_view data, unsigned char *digest) {
+	SHA256(reinterpret_cast<const unsigned char *>(data.data()), data.size(), digest);
+}
+
+/** Calculate the score for a given raw digest */
+long scoreDigest(const unsigned char *raw) {
+	return ((long)raw[5]) + (((long)raw[4]) << 8) + (((long)raw[3]) << 16) + (((long)raw[2]) << 24) + (((long) raw[1]) << 32) + (((long) raw[0]) << 40);
+}
+
+/** Calculate the score for a given hash */
+long scoreHash(const std::string &hash) {
+	return scoreDigest(reinterpret_cast<const unsigned char *>(hash.data()));
+}
+
+/** Calculate the score of a solution's hash using a stack buffer */
+long scoreNonce(std::string_view address, std::string_view block, const unsigned char *nonce, size_t nonceLen) {
+	unsigned char input[64], hashed[SHA256_DIGEST_LENGTH];
+	size_t len = address.size() + block.size() + nonceLen;
+
+	if (len > sizeof(input)) throw std::length_error("Solution input too long");
+
+	std::copy(address.begin(), address.end(), input);
+	std::copy(block.begin(), block.end(), input + address.size());
+	std::copy(nonce, nonce + nonceLen, input + address.size() + block.size());
+
+	SHA256(input, len, hashed);
+
+	return scoreDigest(hashed);
+}
+
+std::string formatHashrate(long hashesPerSecond) {
+	static const char *suffixes[] = {"h/s", "kh/s", "Mh/s", "Gh/s", "Th/s"};
+
+	auto scale = std::max(0, static_cast<int>(0, log(hashesPerSecond) / log(1000)));
+	double value = hashesPerSecond / pow(1000, scale);
+
+	std::stringstream out;
+	out << std::fixed << std::setprecision(2) << value << " " << suffixes[scale];
+	return out.str();
 }
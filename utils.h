@@ -1,9 +1,13 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <stdexcept>
 
+/** Converts the given binary data to hex, writing 2 * len characters to out without allocating */
+void toHex(const unsigned char *data, size_t len, char *out);
+
 /** Converts the given binary data to a hex string */
 std::string toHex(const unsigned char *data, size_t len);
 
@@ -13,6 +17,18 @@ std::string toHex(const std::string &data);
 /** Compute SHA256 of given string and return hex representation */
 std::string sha256hex(const std::string &data);
 
+/** Compute SHA256 of given data, writing the 32 byte raw digest to digest without allocating */
+void sha256(std::string_view data, unsigned char *digest);
+
+/** Calculate the krist score for a raw SHA256 digest, reading its first 6 bytes */
+long scoreDigest(const unsigned char *hash);
+
+/** Calculate the krist score for a given raw hash - a solution is valid if its score is below the work value */
+long scoreHash(const std::string &hash);
+
+/** Calculate the krist score of the hash of address + block + nonce, without allocating */
+long scoreNonce(std::string_view address, std::string_view block, const unsigned char *nonce, size_t nonceLen);
+
 /** Throw an exception if given inputs aren't equal */
 template<typename T>
 void assertEquals(const T &expected, const T &got, const std::string &message) {
@@ -23,5 +39,10 @@ void assertEquals(const T &expected, const T &got, const std::string &message) {
 	}
 }
 
-/** Convert binary data to a string */
-std::string mkString(const unsigned char *data, size_t len);
\ No newline at end of file
+/** Format a hashrate with an appropriate unit suffix, e.g. 1.50 Mh/s */
+std::string formatHashrate(long hashesPerSecond);
+
+/** View binary data as a string, without copying it */
+inline std::string_view bytesView(const unsigned char *data, size_t len) {
+	return {reinterpret_cast<const char *>(data), len};
+}
\ No newline at end of file